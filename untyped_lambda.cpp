@@ -7,25 +7,67 @@
 #include <locale>
 #include <fstream>
 #include <memory>
+#include <functional>
+#include <deque>
+#include <algorithm>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <set>
 #include <map>
 #include <tuple>
+#include <limits>
 #include <clocale>
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <iomanip>
+#include <unordered_map>
 #include <boost/filesystem.hpp>
 #include <boost/optional.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #ifdef _MSC_VER
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
 #include <conio.h>
+#include <intrin.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#endif
+
+// 字句解析で使うSIMD命令．
+#if defined(__AVX2__)
+#define USE_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
 #endif
 
 namespace fs = boost::filesystem;
 
-// vOXCb`D
+// プログラムスイッチ．
 std::set<std::string> program_switchs;
 
-// AvP[VSʂňONXD
-// AvP[VI/O֏o͂O͑SĂoRD
+// 値を取るプログラムスイッチ．
+std::map<std::string, std::string> program_values;
+
+// 値を取るプログラムスイッチか調べる．
+bool takes_value(const std::string &str){
+    return str == "--engine" || str == "-j" || str == "--threads" || str == "--grain" || str == "--max-steps" || str == "--max-time" || str == "--max-nodes" || str == "--compile" || str == "--prelude" || str == "--max-print";
+}
+
+// アプリケーション全般で扱う例外クラス．
+// アプリケーションからI/Oへ出力される例外は全てこれを経由する．
 class app_exception : public std::runtime_error{
 public:
     app_exception() : std::runtime_error("untyped lambda: unknown error."){}
@@ -34,7 +76,7 @@ public:
     virtual ~app_exception(){}
 };
 
-// t@CȂOD
+// ファイルが見つからない例外．
 class no_file_exist : public app_exception{
 public:
     no_file_exist(std::string path) : app_exception("no file exist: " + path){}
@@ -42,14 +84,14 @@ public:
     ~no_file_exist() = default;
 };
 
-// Ch}`oCgɕϊD
+// ワイド文字をマルチバイト文字に変換する．
 std::string wstring_to_string(std::wstring str){
     std::vector<char> v(str.size());
     std::wcstombs(&v[0], str.c_str(), str.size());
     return &v[0];
 }
 
-// t@C̗L`FbND
+// ファイルの有無をチェックする．
 void check_file_exist(const fs::path &path){
     if(!fs::exists(path)){
 #ifdef _MSC_VER
@@ -60,7 +102,7 @@ void check_file_exist(const fs::path &path){
     }
 }
 
-// t@CJۂ̗OD
+// ファイルを開いた際の例外．
 class open_file_exception : public app_exception{
 public:
     open_file_exception(std::string path, std::string msg) : app_exception("file open failed: " + path + " : " + msg){}
@@ -68,35 +110,68 @@ public:
     ~open_file_exception() override{}
 };
 
-// t@CJD
-std::vector<char> open_file(const fs::path &path){
-    try{
-        const boost::uintmax_t size = fs::file_size(path);
-        std::vector<char> r(size);
-        std::ifstream ifile(path.c_str(), std::ios::binary);
-        ifile.read(&r[0], size);
-        return r;
-    }catch(fs::filesystem_error ex){
+// ファイルを読み込み専用でメモリへ写像する．
+// 読み終えた先頭の頁は手放せるので，大きなファイルでも常駐するのは読んでいる辺りだけで済む．
+class mapped_file{
+public:
+    // 頁を手放す単位．
+    static const std::size_t release_unit = 16 * 1024 * 1024;
+
+    mapped_file(const fs::path &path) : released(0){
+        try{
+            // 空のファイルは写像できないので，空の範囲として扱う．
+            if(fs::file_size(path) > 0){
+                mapping = boost::interprocess::file_mapping(path.string().c_str(), boost::interprocess::read_only);
+                region = boost::interprocess::mapped_region(mapping, boost::interprocess::read_only);
+                region.advise(boost::interprocess::mapped_region::advice_sequential);
+            }
+        }catch(const std::exception &ex){
 #ifdef _MSC_VER
-        throw open_file_exception(wstring_to_string(path.c_str()), ex.what());
+            throw open_file_exception(wstring_to_string(path.c_str()), ex.what());
 #else
-        throw open_file_exception(path.c_str(), ex.what());
+            throw open_file_exception(path.c_str(), ex.what());
 #endif
-    }catch(...){
-        throw app_exception();
+        }
+    }
+
+    const char *begin() const{
+        return static_cast<const char*>(region.get_address());
     }
-}
 
-namespace tokenize_phase1{
-    using storage_type = std::vector<char>;
+    const char *end() const{
+        return begin() + region.get_size();
+    }
+
+    // firstより前の頁はもう読まない．
+    void release(const char *first){
+#ifndef _MSC_VER
+        const std::size_t page = boost::interprocess::mapped_region::get_page_size();
+        const std::size_t upto = static_cast<std::size_t>(first - begin()) / page * page;
+        if(upto - released >= release_unit && upto > released){
+            ::madvise(const_cast<char*>(begin()) + released, upto - released, MADV_DONTNEED);
+            released = upto;
+        }
+#endif
+    }
+
+private:
+    boost::interprocess::file_mapping mapping;
+    boost::interprocess::mapped_region region;
+    std::size_t released;
+};
+
+const std::size_t mapped_file::release_unit;
 
+// 字句解析．
+// 入力を一度だけ走査し，空白と(* *)の注釈をその場で読み飛ばす．
+// 字句は入力の領域を指すだけで，文字列を複製しない．
+// 文字の分類はSIMDで一塊ずつ行い，字句の境界はビット演算で求める．
+namespace tokenize_phase{
     struct token_t{
-        enum class kind_t{
-            white,
-            charactor,
-            equal,
-            asterisk,
+        enum class kind_t : unsigned char{
+            variable,
             lambda,
+            equal,
             dot,
             lparen,
             rparen,
@@ -104,313 +179,344 @@ namespace tokenize_phase1{
         };
 
         kind_t kind;
-        storage_type::const_iterator iter;
-        std::size_t line, colunm;
+
+        const char *beg, *end;
+        std::uint32_t line, colunm;
     };
 
     using token_seq_type = std::vector<token_t>;
 
-    token_seq_type tokenize(const storage_type &vec){
-        token_seq_type r;
-        std::size_t line = 0, colunm = 0;
-        for(auto iter = vec.begin(); iter != vec.end(); ++iter){
-            char c = *iter;
-            switch(c){
-            case '/':
-            case '\\':
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::lambda;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    colunm += 1;
-                    r.push_back(t);
-                }
-                break;
+    class unexpected_eof : public app_exception{
+    public:
+        unexpected_eof() : app_exception("detected unexpected eof."){}
+        unexpected_eof(const unexpected_eof&) = default;
+        ~unexpected_eof() = default;
+    };
 
-            case '=':
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::equal;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    colunm++;
-                    r.push_back(t);
-                }
+    inline unsigned count_trailing_zeros(std::uint64_t x){
+#ifdef _MSC_VER
+        unsigned long r;
+        _BitScanForward64(&r, x);
+        return r;
+#else
+        return __builtin_ctzll(x);
+#endif
+    }
+
+    // 一塊の文字の分類．i番目のビットが塊のi番目の文字に対応する．
+    struct block_masks{
+#if defined(USE_AVX2)
+        static const unsigned width = 32;
+#else
+        static const unsigned width = 16;
+#endif
+
+        // 変数名を区切る文字．
+        std::uint64_t delimiter;
+        // 一文字で字句になる文字．
+        std::uint64_t punct;
+        std::uint64_t star;
+        // 行と桁の数え方を変える文字．タブと改行．
+        std::uint64_t layout;
+    };
+
+    const unsigned block_masks::width;
+
+#if defined(USE_AVX2)
+    inline block_masks classify(const char *p){
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        auto eq = [&](char c){ return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)); };
+        auto bits = [](__m256i m){ return static_cast<std::uint64_t>(static_cast<std::uint32_t>(_mm256_movemask_epi8(m))); };
+        const __m256i layout = _mm256_or_si256(eq('\t'), _mm256_or_si256(eq('\n'), eq('\r')));
+        const __m256i star = eq('*');
+        const __m256i punct = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(eq('/'), eq('\\')), _mm256_or_si256(eq('='), eq('.'))),
+            _mm256_or_si256(eq('('), eq(')'))
+        );
+        block_masks r;
+        r.delimiter = bits(_mm256_or_si256(_mm256_or_si256(eq(' '), layout), _mm256_or_si256(star, punct)));
+        r.punct = bits(punct);
+        r.star = bits(star);
+        r.layout = bits(layout);
+        return r;
+    }
+#elif defined(USE_SSE2)
+    inline block_masks classify(const char *p){
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        auto eq = [&](char c){ return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); };
+        auto bits = [](__m128i m){ return static_cast<std::uint64_t>(_mm_movemask_epi8(m)); };
+        const __m128i layout = _mm_or_si128(eq('\t'), _mm_or_si128(eq('\n'), eq('\r')));
+        const __m128i star = eq('*');
+        const __m128i punct = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(eq('/'), eq('\\')), _mm_or_si128(eq('='), eq('.'))),
+            _mm_or_si128(eq('('), eq(')'))
+        );
+        block_masks r;
+        r.delimiter = bits(_mm_or_si128(_mm_or_si128(eq(' '), layout), _mm_or_si128(star, punct)));
+        r.punct = bits(punct);
+        r.star = bits(star);
+        r.layout = bits(layout);
+        return r;
+    }
+#else
+    inline block_masks classify(const char *p){
+        block_masks r = {};
+        for(unsigned i = 0; i < block_masks::width; ++i){
+            const std::uint64_t bit = std::uint64_t(1) << i;
+            switch(p[i]){
+            case '\t':
+            case '\n':
+            case '\r':
+                r.layout |= bit;
+                r.delimiter |= bit;
                 break;
-            
+
             case '*':
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::asterisk;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    colunm++;
-                    r.push_back(t);
-                }
+                r.star |= bit;
+                r.delimiter |= bit;
                 break;
 
-            case '.':
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::dot;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    colunm++;
-                    r.push_back(t);
-                }
+            case ' ':
+                r.delimiter |= bit;
                 break;
 
+            case '/':
+            case '\\':
+            case '=':
+            case '.':
             case '(':
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::lparen;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    colunm++;
-                    r.push_back(t);
-                }
-                break;
-
             case ')':
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::rparen;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    colunm++;
-                    r.push_back(t);
-                }
+                r.punct |= bit;
+                r.delimiter |= bit;
                 break;
 
-            case ' ':
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::white;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    r.push_back(t);
-                }
-                colunm++;
+            default:
                 break;
+            }
+        }
+        return r;
+    }
+#endif
 
-            case '\t':
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::white;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    r.push_back(t);
-                }
-                colunm += 4;
-                break;
+    // 入力を塊に分けて字句を切り出す．
+    // 桁は行頭からの距離とタブの数から求めるので，
+    // 一文字ずつ数えるのはタブと改行だけで済む．
+    // 一塊ずつ進められるので，入力の全てを字句にしなくても先頭から順に読み出せる．
+    class lexer{
+    public:
+        lexer(const char *first, const char *last) : pos(first), last(last), carry(0), open(no_token), finished(false), line(0), line_start(first), tabs(0){}
 
-            case '\n':
-            case '\r':
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::white;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    r.push_back(t);
-                }
-                if(c == '\n'){
-                    ++line;
-                }
-                colunm = 0;
-                break;
+        token_seq_type run(){
+            while(step());
+            return std::move(r);
+        }
 
-            default:
-                {
-                    token_t t;
-                    t.kind = token_t::kind_t::charactor;
-                    t.iter = iter;
-                    t.line = line;
-                    t.colunm = colunm;
-                    colunm++;
-                    r.push_back(t);
+        // 次の一塊を字句にしてget_tokensの末尾へ加える．
+        // 入力の終わりではend字句を加えてfalseを返す．
+        bool step(){
+            if(finished){
+                return false;
+            }
+            if(pos == last){
+                finish();
+                return false;
+            }
+            const std::uint64_t valid = load(pos);
+            const std::uint64_t ident = ~masks.delimiter & valid;
+            const std::uint64_t starts = ident & ~((ident << 1) | carry);
+            const std::uint64_t ends = masks.delimiter & valid & ((ident << 1) | carry);
+            std::uint64_t events = starts | ends | (masks.punct & valid);
+            while(events){
+                const unsigned i = count_trailing_zeros(events);
+                const std::uint64_t bit = std::uint64_t(1) << i;
+                events &= events - 1;
+                const char *p = base + i;
+                settle(bit - 1);
+                if(ends & bit){
+                    r[open].end = p;
+                    open = no_token;
+                }
+                if(starts & bit){
+                    open = r.size();
+                    push(token_t::kind_t::variable, p, nullptr);
+                }else if(masks.punct & bit){
+                    if(*p == '(' && p + 1 != last && *(p + 1) == '*'){
+                        // 注釈の後は塊の途中から読み直す．
+                        pos = skip_comment(p + 2);
+                        carry = 0;
+                        return true;
+                    }
+                    push(punct_kind(*p), p, p + 1);
                 }
-                break;
             }
+            settle(valid);
+            carry = (ident >> (count - 1)) & 1;
+            pos = base + count;
+            return true;
         }
-        {
-            token_t t;
-            t.kind = token_t::kind_t::end;
-            t.iter = vec.end();
-            t.line = line;
-            t.colunm = colunm + 1;
-            r.push_back(t);
+
+        token_seq_type &get_tokens(){
+            return r;
         }
-        return std::move(r);
-    }
-}
 
-namespace tokenize_phase2{
-    using storage_type = std::vector<char>;
+        // 終わりまで決まった字句の数．
+        std::size_t get_complete() const{
+            return open == no_token ? r.size() : open;
+        }
 
-    struct token_t{
-        enum class kind_t{
-            variable,
-            lambda,
-            equal,
-            dot,
-            lparen,
-            rparen,
-            end
-        };
+        // まだ字句にしていない入力の先頭．
+        const char *get_position() const{
+            return pos;
+        }
 
-        kind_t kind;
+        // 先頭のn個の字句を捨てる．
+        void drop(std::size_t n){
+            r.erase(r.begin(), r.begin() + n);
+            if(open != no_token){
+                open -= n;
+            }
+        }
 
-        storage_type::const_iterator beg, end;
-        std::size_t line, colunm;
-    };
+    private:
+        static const std::size_t no_token = static_cast<std::size_t>(-1);
 
-    using token_seq_type = std::vector<token_t>;
+        static token_t::kind_t punct_kind(char c){
+            switch(c){
+            case '=':
+                return token_t::kind_t::equal;
 
-    class unexpected_eof : public app_exception{
-    public:
-        unexpected_eof() : app_exception("detected unexpected eof."){}
-        unexpected_eof(const unexpected_eof&) = default;
-        ~unexpected_eof() = default;
-    };
+            case '.':
+                return token_t::kind_t::dot;
 
-    token_seq_type tokenize(const tokenize_phase1::token_seq_type &vec){
-        token_seq_type r;
-        for(auto iter = vec.begin(); iter != vec.end(); ++iter){
-            auto t = *iter;
-            if(t.kind == tokenize_phase1::token_t::kind_t::lparen){
-                auto lookahead = *(iter + 1);
-                if(lookahead.kind == tokenize_phase1::token_t::kind_t::asterisk){
-                    iter += 2;
-                    for(; ; ++iter){
-                        t = *iter;
-                        if(t.kind == tokenize_phase1::token_t::kind_t::end){
-                            throw unexpected_eof();
-                        }
-                        if(
-                            t.kind == tokenize_phase1::token_t::kind_t::asterisk &&
-                            (iter + 1)->kind == tokenize_phase1::token_t::kind_t::rparen
-                        ){
-                            ++iter;
-                            break;
-                        }
-                    }
-                    continue;
-                }else{
-                    token_t u;
-                    u.beg = t.iter;
-                    u.end = t.iter + 1;
-                    u.line = t.line;
-                    u.colunm = t.colunm;
-                    u.kind = token_t::kind_t::lparen;
-                    r.push_back(u);
-                    continue;
-                }
-            }else if(t.kind != tokenize_phase1::token_t::kind_t::charactor){
-                switch(t.kind){
-                case tokenize_phase1::token_t::kind_t::lambda:
-                    {
-                        token_t u;
-                        u.beg = t.iter;
-                        u.end = t.iter + 1;
-                        u.line = t.line;
-                        u.colunm = t.colunm;
-                        u.kind = token_t::kind_t::lambda;
-                        r.push_back(u);
-                    }
-                    break;
+            case '(':
+                return token_t::kind_t::lparen;
 
-                case tokenize_phase1::token_t::kind_t::equal:
-                    {
-                        token_t u;
-                        u.beg = t.iter;
-                        u.end = t.iter + 1;
-                        u.line = t.line;
-                        u.colunm = t.colunm;
-                        u.kind = token_t::kind_t::equal;
-                        r.push_back(u);
-                    }
-                    break;
+            case ')':
+                return token_t::kind_t::rparen;
 
-                case tokenize_phase1::token_t::kind_t::dot:
-                    {
-                        token_t u;
-                        u.beg = t.iter;
-                        u.end = t.iter + 1;
-                        u.line = t.line;
-                        u.colunm = t.colunm;
-                        u.kind = token_t::kind_t::dot;
-                        r.push_back(u);
-                    }
-                    break;
+            default:
+                return token_t::kind_t::lambda;
+            }
+        }
 
-                case tokenize_phase1::token_t::kind_t::lparen:
-                    {
-                        token_t u;
-                        u.beg = t.iter;
-                        u.end = t.iter + 1;
-                        u.line = t.line;
-                        u.colunm = t.colunm;
-                        u.kind = token_t::kind_t::lparen;
-                        r.push_back(u);
-                    }
-                    break;
+        // firstから一塊を分類し，有効な文字のビットを返す．
+        std::uint64_t load(const char *first){
+            base = first;
+            if(last - first >= static_cast<std::ptrdiff_t>(block_masks::width)){
+                count = block_masks::width;
+                masks = classify(first);
+            }else{
+                char tail[block_masks::width] = {};
+                count = static_cast<unsigned>(last - first);
+                std::copy(first, last, tail);
+                masks = classify(tail);
+            }
+            pending = masks.layout;
+            return (std::uint64_t(1) << count) - 1;
+        }
 
-                case tokenize_phase1::token_t::kind_t::rparen:
-                    {
-                        token_t u;
-                        u.beg = t.iter;
-                        u.end = t.iter + 1;
-                        u.line = t.line;
-                        u.colunm = t.colunm;
-                        u.kind = token_t::kind_t::rparen;
-                        r.push_back(u);
+        // 塊の中でbelowの範囲にあるタブと改行を数える．
+        void settle(std::uint64_t below){
+            std::uint64_t m = pending & below;
+            pending &= ~below;
+            while(m){
+                const char *p = base + count_trailing_zeros(m);
+                m &= m - 1;
+                if(*p == '\t'){
+                    ++tabs;
+                }else{
+                    if(*p == '\n'){
+                        ++line;
                     }
-                    break;
+                    line_start = p + 1;
+                    tabs = 0;
+                }
+            }
+        }
 
-                case tokenize_phase1::token_t::kind_t::end:
-                    {
-                        token_t u;
-                        u.beg = t.iter;
-                        u.end = t.iter;
-                        u.line = t.line;
-                        u.colunm = t.colunm;
-                        u.kind = token_t::kind_t::end;
-                        r.push_back(u);
+        // 注釈の本体の先頭firstから読み飛ばし，注釈の次の位置を返す．
+        const char *skip_comment(const char *first){
+            for(const char *iter = first; iter != last; iter = base + count){
+                const std::uint64_t valid = load(iter);
+                for(std::uint64_t stars = masks.star & valid; stars; stars &= stars - 1){
+                    const unsigned i = count_trailing_zeros(stars);
+                    const char *p = base + i;
+                    if(p + 1 != last && *(p + 1) == ')'){
+                        settle((std::uint64_t(1) << i) - 1);
+                        return p + 2;
                     }
-                    break;
-                }
-                continue;
-            }else if(t.kind == tokenize_phase1::token_t::kind_t::charactor){
-                token_t u;
-                u.beg = t.iter;
-                u.line = t.line;
-                u.colunm = t.colunm;
-                u.kind = token_t::kind_t::variable;
-                while(iter->kind == tokenize_phase1::token_t::kind_t::charactor){
-                    ++iter;
                 }
-                u.end = iter->iter;
-                --iter;
-                r.push_back(u);
-                continue;
+                settle(valid);
             }
+            throw unexpected_eof();
         }
-        return r;
+
+        std::uint32_t colunm(const char *p) const{
+            return static_cast<std::uint32_t>((p - line_start) + 3 * tabs);
+        }
+
+        void push(token_t::kind_t kind, const char *beg, const char *end){
+            token_t t;
+            t.kind = kind;
+            t.beg = beg;
+            t.end = end;
+            t.line = line;
+            t.colunm = colunm(beg);
+            r.push_back(t);
+        }
+
+        void finish(){
+            if(open != no_token){
+                r[open].end = last;
+                open = no_token;
+            }
+            token_t t;
+            t.kind = token_t::kind_t::end;
+            t.beg = last;
+            t.end = last;
+            t.line = line;
+            t.colunm = colunm(last) + 1;
+            r.push_back(t);
+            finished = true;
+        }
+
+        const char *pos;
+        const char *last;
+        token_seq_type r;
+        // 直前の塊が変数名の途中で終わったか．
+        std::uint64_t carry;
+        // 終わりの見つかっていない変数名の字句．
+        std::size_t open;
+        bool finished;
+        std::uint32_t line;
+        const char *line_start;
+        std::size_t tabs;
+        const char *base;
+        unsigned count;
+        block_masks masks;
+        // 塊の中でまだ数えていないタブと改行．
+        std::uint64_t pending;
+    };
+
+    const std::size_t lexer::no_token;
+
+    token_seq_type tokenize(const char *first, const char *last){
+        return lexer(first, last).run();
     }
 }
 
-// ɌvZ̓\\D
+// λ計算の内部表現構造．
+// 式の深さはλ式の大きさに比例して深くなるので，
+// 式を辿る処理は再帰を使わずヒープ上の作業リストで行う．
 namespace internal_data{
+    struct expr;
+
+    expr *copy_expr(const expr *e);
+    std::string expr_to_str(const expr *e);
+    bool print(std::ostream &out, const expr *e, std::size_t limit);
+    bool equal_expr(const expr *a, const expr *b);
+    void dispose(std::vector<std::unique_ptr<expr>> &vec);
+
     struct expr{
         enum class kind{
             variable,
@@ -418,13 +524,10 @@ namespace internal_data{
             lambda
         };
 
-        using variable_map = std::map<std::string, const expr*>;
         using expr_lookup_table = std::map<std::string, std::unique_ptr<expr>>;
 
         virtual kind get_kind() const = 0;
         virtual expr *copy() const = 0;
-        virtual expr *replace(const variable_map&, const expr_lookup_table&, bool &mod) const = 0;
-        virtual expr *local_replace(const variable_map&, bool &mod) const = 0;
         virtual std::string to_str() const = 0;
         virtual bool equal(const expr*) const = 0;
         virtual ~expr() = default;
@@ -441,32 +544,6 @@ namespace internal_data{
             return r;
         }
 
-        expr *replace(const variable_map &map, const expr_lookup_table &global_map, bool &mod) const override{
-            auto iter = map.find(str);
-            if(iter != map.end()){
-                mod = true;
-                return iter->second->copy();
-            }else{
-                auto jter = global_map.find(str);
-                if(jter != global_map.end()){
-                    mod = true;
-                    return jter->second->copy();
-                }else{
-                    return copy();
-                }
-            }
-        }
-
-        expr *local_replace(const variable_map &map, bool &mod) const{
-            auto iter = map.find(str);
-            if(iter != map.end()){
-                mod = true;
-                return iter->second->copy();
-            }else{
-                return copy();
-            }
-        }
-
         std::string to_str() const override{
             return str;
         }
@@ -481,67 +558,24 @@ namespace internal_data{
     };
 
     struct sequence : public expr{
+        ~sequence(){
+            dispose(vec);
+        }
+
         kind get_kind() const override{
             return kind::sequence;
         }
 
         expr *copy() const override{
-            sequence *r = new sequence;
-            for(auto iter = vec.begin(); iter != vec.end(); ++iter){
-                r->push_back(std::move(std::unique_ptr<expr>((*iter)->copy())));
-            }
-            return r;
-        }
-
-        expr *replace(const variable_map &map, const expr_lookup_table &global_map, bool &mod) const override{
-            sequence *r = new sequence;
-            for(auto iter = vec.begin(); iter != vec.end(); ++iter){
-                r->push_back(std::move(std::unique_ptr<expr>((*iter)->replace(map, global_map, mod))));
-            }
-            return r;
-        }
-
-        virtual expr *local_replace(const variable_map &map, bool &mod) const{
-            sequence *r = new sequence;
-            for(auto iter = vec.begin(); iter != vec.end(); ++iter){
-                r->push_back(std::move(std::unique_ptr<expr>((*iter)->local_replace(map, mod))));
-            }
-            return r;
+            return copy_expr(this);
         }
 
         std::string to_str() const override{
-            std::string r;
-            std::size_t count = 0;
-            for(auto &i : vec){
-                bool nest = i->get_kind() == kind::sequence || i->get_kind() == kind::lambda;
-                if(nest){
-                    r += "(";
-                }
-                r += i->to_str();
-                if(nest){
-                    r += ")";
-                }
-                if(count < vec.size() - 1){
-                    r += " ";
-                }
-                ++count;
-            }
-            return std::move(r);
+            return expr_to_str(this);
         }
 
         virtual bool equal(const expr *other) const{
-            if(other->get_kind() != expr::kind::sequence){
-                return false;
-            }
-            const sequence *other_seq = static_cast<const sequence*>(other);
-            auto iter = vec.begin();
-            for(auto &i : other_seq->vec){
-                if(!i->equal(&*i)){
-                    return false;
-                }
-                ++iter;
-            }
-            return true;
+            return equal_expr(this, other);
         }
 
         std::vector<std::unique_ptr<expr>> vec;
@@ -553,216 +587,4427 @@ namespace internal_data{
     struct lambda : public expr{
         lambda() : seq(new sequence){}
 
+        ~lambda(){
+            if(seq){
+                std::vector<std::unique_ptr<expr>> vec;
+                vec.push_back(std::move(seq));
+                dispose(vec);
+            }
+        }
+
         kind get_kind() const{
             return kind::lambda;
         }
 
         expr *copy() const{
-            lambda *r = new lambda;
-            for(auto iter = variable_seq.begin(); iter != variable_seq.end(); ++iter){
-                variable v;
-                v.str = iter->str;
-                r->variable_seq.push_back(v);
-            }
-            for(auto iter = get_seq()->vec.begin(); iter != get_seq()->vec.end(); ++iter){
-                r->get_seq()->push_back(std::move(std::unique_ptr<expr>((*iter)->copy())));
-            }
-            return r;
+            return copy_expr(this);
         }
 
-        variable_map make_dropped_map(const variable_map &map) const{
-            variable_map dropped_map = map;
-            for(const variable &var_seq_iter : variable_seq){
-                auto iter = dropped_map.find(var_seq_iter.str);
-                if(iter != dropped_map.end()){
-                    dropped_map.erase(iter);
-                }
-            }
-            return std::move(dropped_map);
+        std::string to_str() const{
+            return expr_to_str(this);
         }
 
-        expr *replace(const variable_map &map, const expr_lookup_table &global_map, bool &mod) const{
-            variable_map dropped_map = make_dropped_map(map);
-            lambda *lam = new lambda;
-            lam->variable_seq = variable_seq;
-            std::unique_ptr<expr> seq_prime(seq->copy());
-            lam->seq.swap(seq_prime);
-            std::unique_ptr<expr> f(seq->replace(dropped_map, global_map, mod));
-            f.swap(lam->seq);
-            return lam;
+        bool equal(const expr *other) const{
+            return equal_expr(this, other);
         }
 
-        virtual expr *local_replace(const variable_map &map, bool &mod) const{
-            variable_map dropped_map = make_dropped_map(map);
-            lambda *lam = new lambda;
-            lam->variable_seq = variable_seq;
-            std::unique_ptr<expr> seq_prime(seq->copy());
-            lam->seq.swap(seq_prime);
-            std::unique_ptr<expr> f(seq->local_replace(dropped_map, mod));
-            f.swap(lam->seq);
-            return lam;
-        }
+        std::vector<variable> variable_seq;
+        mutable std::unique_ptr<expr> seq;
 
-        std::string to_str() const{
-            std::string r;
-            r += "/";
+        sequence *get_seq() const{
+            return static_cast<sequence*>(seq.get());
+        }
+    };
+
+    // 式を複製する．
+    expr *copy_expr(const expr *e){
+        struct item{
+            const expr *src;
+            std::unique_ptr<expr> *dst;
+        };
+
+        std::unique_ptr<expr> r;
+        std::vector<item> work;
+        work.push_back(item{e, &r});
+        while(!work.empty()){
+            item i = work.back();
+            work.pop_back();
+            switch(i.src->get_kind()){
+            case expr::kind::variable:
+                i.dst->reset(i.src->copy());
+                break;
+
+            case expr::kind::sequence:
+                {
+                    const sequence *src = static_cast<const sequence*>(i.src);
+                    sequence *dst = new sequence;
+                    i.dst->reset(dst);
+                    dst->vec.resize(src->vec.size());
+                    for(std::size_t n = 0; n < src->vec.size(); ++n){
+                        work.push_back(item{src->vec[n].get(), &dst->vec[n]});
+                    }
+                }
+                break;
+
+            case expr::kind::lambda:
+                {
+                    const lambda *src = static_cast<const lambda*>(i.src);
+                    lambda *dst = new lambda;
+                    i.dst->reset(dst);
+                    dst->variable_seq = src->variable_seq;
+                    work.push_back(item{src->seq.get(), &dst->seq});
+                }
+                break;
+            }
+        }
+        return r.release();
+    }
+
+    // 式をoutへ直接書き出す．
+    // 作業リストには式か，そのまま出力する文字列を積む．
+    // limitは書き出す変数名と束縛変数名の数の上限で，超えたら"..."を書いて打ち切りfalseを返す．0なら制限しない．
+    bool print(std::ostream &out, const expr *e, std::size_t limit){
+        struct item{
+            const expr *e;
+            const char *text;
+        };
+
+        std::size_t count = 0;
+        std::vector<item> work;
+        work.push_back(item{e, nullptr});
+        while(!work.empty()){
+            item i = work.back();
+            work.pop_back();
+            if(!i.e){
+                out << i.text;
+                continue;
+            }
+            switch(i.e->get_kind()){
+            case expr::kind::variable:
+                if(limit && count++ == limit){
+                    out << "...";
+                    return false;
+                }
+                out << static_cast<const variable*>(i.e)->str;
+                break;
+
+            case expr::kind::sequence:
+                {
+                    const std::vector<std::unique_ptr<expr>> &vec = static_cast<const sequence*>(i.e)->vec;
+                    for(std::size_t n = vec.size(); n-- > 0; ){
+                        bool nest = vec[n]->get_kind() == expr::kind::sequence || vec[n]->get_kind() == expr::kind::lambda;
+                        if(n < vec.size() - 1){
+                            work.push_back(item{nullptr, " "});
+                        }
+                        if(nest){
+                            work.push_back(item{nullptr, ")"});
+                        }
+                        work.push_back(item{vec[n].get(), nullptr});
+                        if(nest){
+                            work.push_back(item{nullptr, "("});
+                        }
+                    }
+                }
+                break;
+
+            case expr::kind::lambda:
+                {
+                    const lambda *lam = static_cast<const lambda*>(i.e);
+                    out << "/";
+                    for(std::size_t n = 0; n < lam->variable_seq.size(); ++n){
+                        if(n > 0){
+                            out << " ";
+                        }
+                        if(limit && count++ == limit){
+                            out << "...";
+                            return false;
+                        }
+                        out << lam->variable_seq[n].str;
+                    }
+                    out << ". ";
+                    work.push_back(item{lam->seq.get(), nullptr});
+                }
+                break;
+            }
+        }
+        return true;
+    }
+
+    // 式を文字列にする．
+    std::string expr_to_str(const expr *e){
+        std::ostringstream out;
+        print(out, e, 0);
+        return out.str();
+    }
+
+    // 子の式を作業リストへ移しながら破棄する．
+    // unique_ptrの連鎖による再帰的な破棄を避ける．
+    void dispose(std::vector<std::unique_ptr<expr>> &vec){
+        if(vec.empty()){
+            return;
+        }
+        std::vector<std::unique_ptr<expr>> work;
+        work.swap(vec);
+        while(!work.empty()){
+            std::unique_ptr<expr> e(std::move(work.back()));
+            work.pop_back();
+            if(!e){
+                continue;
+            }
+            if(e->get_kind() == expr::kind::sequence){
+                for(auto &i : static_cast<sequence*>(e.get())->vec){
+                    work.push_back(std::move(i));
+                }
+                static_cast<sequence*>(e.get())->vec.clear();
+            }else if(e->get_kind() == expr::kind::lambda){
+                work.push_back(std::move(static_cast<lambda*>(e.get())->seq));
+            }
+        }
+    }
+
+    expr::expr_lookup_table assignment_table;
+
+    // 名前なし表現へまだ変換していない代入式．
+    std::vector<expr::expr_lookup_table::const_iterator> pending_assignments;
+
+    // 代入式を登録する．同じ名前の代入式が既にあれば先のものを残す．
+    void assign(const std::string &name, std::unique_ptr<expr> e){
+        auto inserted = assignment_table.insert(std::make_pair(name, std::move(e)));
+        if(inserted.second){
+            pending_assignments.push_back(inserted.first);
+        }
+    }
+
+    // 代入式の展開が自身に戻ってきた．
+    class recursive_definition : public app_exception{
+    public:
+        recursive_definition(std::string name) : app_exception("recursive definition cannot be expanded: " + name){}
+        recursive_definition(const recursive_definition&) = default;
+        ~recursive_definition() = default;
+    };
+
+    // 代入式の左辺を右辺で置き換える．
+    // 展開中の代入式を辿れるように，展開ごとに名前と親の展開の番号を記録する．
+    void global_variable_replace(std::unique_ptr<expr> &e){
+        struct expansion{
+            const std::string *name;
+            std::size_t parent;
+        };
+
+        struct item{
+            std::unique_ptr<expr> *e;
+            std::size_t expansion;
+        };
+
+        const std::size_t none = static_cast<std::size_t>(-1);
+        std::vector<expansion> expansions;
+        std::vector<item> work;
+        work.push_back(item{&e, none});
+        while(!work.empty()){
+            item i = work.back();
+            work.pop_back();
+            expr *p = i.e->get();
+            if(p->get_kind() == expr::kind::variable){
+                variable *var = static_cast<variable*>(p);
+                auto iter = assignment_table.find(var->str);
+                if(iter != assignment_table.end()){
+                    for(std::size_t n = i.expansion; n != none; n = expansions[n].parent){
+                        if(*expansions[n].name == iter->first){
+                            throw recursive_definition(iter->first);
+                        }
+                    }
+                    expansions.push_back(expansion{&iter->first, i.expansion});
+                    i.e->reset(iter->second->copy());
+                    work.push_back(item{i.e, expansions.size() - 1});
+                }
+            }else if(p->get_kind() == expr::kind::lambda){
+                work.push_back(item{&static_cast<lambda*>(p)->seq, i.expansion});
+            }else if(p->get_kind() == expr::kind::sequence){
+                for(auto &j : static_cast<sequence*>(p)->vec){
+                    work.push_back(item{&j, i.expansion});
+                }
+            }
+        }
+    }
+
+    std::vector<std::unique_ptr<expr>> lines;
+}
+
+// de Bruijn指標によるλ計算の名前なし内部表現．
+// 構文木はここへ変換してから簡約し，表示時に名前付きの構文木へ戻す．
+namespace nameless_data{
+    // 記号表．
+    // 自由変数と束縛変数の名前は全て記号番号で扱う．
+    struct symbol_table{
+        std::size_t intern(const std::string &str){
+            auto iter = ids.find(str);
+            if(iter != ids.end()){
+                return iter->second;
+            }
+            std::size_t id = names.size();
+            names.push_back(str);
+            ids.insert(std::make_pair(str, id));
+            return id;
+        }
+
+        const std::string &name(std::size_t id) const{
+            return names[id];
+        }
+
+        std::vector<std::string> names;
+        std::map<std::string, std::size_t> ids;
+    };
+
+    symbol_table symbols;
+
+    class term_arena;
+
+    // 項の節．
+    // 一度作った節は書き換えず，参照数を数えて部分項を共有する．
+    struct term{
+        enum class kind : unsigned char{
+            bound,
+            free,
+            application,
+            abstraction
+        };
+
+        kind get_kind() const{
+            return k;
+        }
+
+        kind k;
+
+        // 正規形の表に置かれた，束縛変数名まで等しい項の代表の節か．
+        bool canonical;
+
+        // canonicalのとき，展開できる代入式の左辺を含むか．
+        bool globals;
+
+        // 構造から求めた値．抽象の束縛変数名は含めないので，α同値な項は同じ値になる．
+        std::uint32_t hash;
+
+        // bound : de Bruijn指標．
+        // free : 記号番号．
+        // abstraction : 表示用の束縛変数名の記号番号．
+        std::size_t value;
+
+        // application : 関数部と引数部．
+        // abstraction : lhsが本体．
+        // 子の節への参照を一つずつ保持する．
+        const term *lhs, *rhs;
+
+        mutable std::uint32_t refs;
+
+        // 部分項の外で束縛される指標の数．どの指標もこれより小さい．
+        // 0なら閉じた項で，代入やずらしで変わらない．
+        std::uint32_t loose;
+
+        // 節を確保した領域．参照されなくなった節はここへ戻す．
+        term_arena *arena;
+    };
+
+    // 項の確保領域．
+    // 節を塊ごとに確保し，一行の評価が終わるたびにまとめて解放する．
+    // 評価の途中で参照されなくなった節は空きリストに戻して再利用する．
+    class term_arena{
+    public:
+        static const std::size_t block_size = 4096;
+
+        term_arena() : block_index(0), used(0), free_list(nullptr), live(0), peak(0), high_water(0), external(0), node_high_water(0){}
+        term_arena(const term_arena&) = delete;
+
+        term *allocate(){
+            term *r;
+            if(free_list){
+                r = free_list;
+                free_list = const_cast<term*>(r->lhs);
+            }else{
+                if(used == block_size){
+                    ++block_index;
+                    used = 0;
+                }
+                if(block_index == blocks.size()){
+                    blocks.push_back(std::unique_ptr<term[]>(new term[block_size]));
+                }
+                r = &blocks[block_index][used++];
+            }
+            r->arena = this;
+            ++live;
+            if(live > peak){
+                peak = live;
+                if(peak > high_water){
+                    high_water = peak;
+                }
+            }
+            if(live + external > node_high_water){
+                node_high_water = live + external;
+            }
+            return r;
+        }
+
+        void deallocate(const term *t){
+            term *p = const_cast<term*>(t);
+            p->lhs = free_list;
+            free_list = p;
+            --live;
+        }
+
+        // 確保した節を全て解放する．
+        // 塊そのものは次の行のために残しておく．
+        void release(){
+            block_index = 0;
+            used = 0;
+            free_list = nullptr;
+            live = 0;
+            peak = 0;
+        }
+
+        std::size_t get_live() const{
+            return live;
+        }
+
+        // 前回の解放からの最大使用節数．
+        std::size_t get_peak() const{
+            return peak;
+        }
+
+        // 全体を通しての最大使用節数．
+        std::size_t get_high_water() const{
+            return high_water;
+        }
+
+        // 評価器がこの領域の外に作った節(グラフの節，閉包，値，相互作用網の節)を数える．
+        // 行ごとの解放では減らさず，評価器が節を壊したときに減らす．
+        void count_external(std::size_t n){
+            external += n;
+            if(live + external > node_high_water){
+                node_high_water = live + external;
+            }
+        }
+
+        void uncount_external(std::size_t n){
+            external -= n;
+        }
+
+        // 全体を通しての，項の節と評価器が外に作った節を合わせた最大数．
+        std::size_t get_node_high_water() const{
+            return node_high_water;
+        }
+
+        std::size_t get_capacity() const{
+            return blocks.size() * block_size;
+        }
+
+    private:
+        std::vector<std::unique_ptr<term[]>> blocks;
+        std::size_t block_index, used;
+        term *free_list;
+        std::size_t live, peak, high_water;
+        std::size_t external, node_high_water;
+    };
+
+    // 代入式の右辺を置く確保領域．解放しない．
+    term_arena definition_arena;
+
+    // 評価中の行の項を置く確保領域．
+    // 評価器ごとに独立させてロックを避ける．
+    thread_local term_arena line_arena;
+
+    thread_local term_arena *current_arena = nullptr;
+
+    // 評価器が項の確保領域の外に作る節．作るときと壊すときに評価中の行の確保領域で数える．
+    struct counted_node{
+        counted_node(){
+            line_arena.count_external(1);
+        }
+
+        counted_node(const counted_node&){
+            line_arena.count_external(1);
+        }
+
+        counted_node &operator =(const counted_node&) = default;
+
+        ~counted_node(){
+            line_arena.uncount_external(1);
+        }
+    };
+
+    term_arena &get_arena(){
+        return current_arena ? *current_arena : line_arena;
+    }
+
+    // 確保領域を一時的に切り替える．
+    class arena_switch{
+    public:
+        arena_switch(term_arena &arena) : prev(current_arena){
+            current_arena = &arena;
+        }
+
+        ~arena_switch(){
+            current_arena = prev;
+        }
+
+    private:
+        term_arena *prev;
+    };
+
+    // 破棄時に確保領域をまとめて解放する．
+    // 解放する領域の項を指すterm_refより先に宣言すること．
+    class arena_release{
+    public:
+        arena_release(term_arena &arena) : arena(arena){}
+
+        ~arena_release(){
+            arena.release();
+        }
+
+    private:
+        term_arena &arena;
+    };
+
+    // 固定された節の参照数．
+    // 代入式の節は全ての評価器から共有するので数えない．
+    const std::uint32_t pinned_refs = static_cast<std::uint32_t>(-1);
+
+    void retain(const term *t){
+        if(t && t->refs != pinned_refs){
+            ++t->refs;
+        }
+    }
+
+    // 参照数が0になった節の子を順に手放す．
+    // 長い連鎖でもスタックを使わないよう，解放する節は作業リストに積む．
+    // 節は今の確保領域ではなく，節を確保した領域へ戻す．
+    thread_local std::vector<const term*> release_work;
+
+    void release_cascade(const term *t){
+        std::vector<const term*> &work = release_work;
+        work.push_back(t);
+        while(!work.empty()){
+            t = work.back();
+            work.pop_back();
+            const term *children[2] = { t->lhs, t->rhs };
+            t->arena->deallocate(t);
+            for(const term *c : children){
+                if(c && c->refs != pinned_refs && --c->refs == 0){
+                    work.push_back(c);
+                }
+            }
+        }
+    }
+
+    inline void release(const term *t){
+        if(t && t->refs != pinned_refs && --t->refs == 0){
+            release_cascade(t);
+        }
+    }
+
+    // 節への参照．
+    class term_ref{
+    public:
+        term_ref() : ptr(nullptr){}
+
+        explicit term_ref(const term *t) : ptr(t){
+            retain(ptr);
+        }
+
+        term_ref(const term_ref &other) : ptr(other.ptr){
+            retain(ptr);
+        }
+
+        term_ref(term_ref &&other) : ptr(other.ptr){
+            other.ptr = nullptr;
+        }
+
+        ~term_ref(){
+            release(ptr);
+        }
+
+        term_ref &operator =(term_ref other){
+            std::swap(ptr, other.ptr);
+            return *this;
+        }
+
+        const term *get() const{
+            return ptr;
+        }
+
+        const term *operator ->() const{
+            return ptr;
+        }
+
+        explicit operator bool() const{
+            return ptr != nullptr;
+        }
+
+        // 参照を手放して節を返す．
+        const term *detach(){
+            const term *r = ptr;
+            ptr = nullptr;
+            return r;
+        }
+
+    private:
+        const term *ptr;
+    };
+
+    // 節の構造の値の，子の値についての一次式 scale * x + offset．
+    struct hash_map{
+        std::uint32_t scale, offset;
+
+        std::uint32_t operator ()(std::uint32_t x) const{
+            return scale * x + offset;
+        }
+
+        // 先にinnerを施してから自身を施す一次式．
+        hash_map operator *(const hash_map &inner) const{
+            return hash_map{scale * inner.scale, scale * inner.offset + offset};
+        }
+    };
+
+    // 関数適用と抽象の値は子の値の一次式にしておく．
+    // 根までの道筋に沿って一次式を合成しておけば，部分項を置き換えたときの根の値が組み立てずに求まる．
+    const std::uint32_t hash_lhs = 0x9e3779b1u, hash_rhs = 0x85ebca77u, hash_application = 0xc2b2ae3du;
+    const std::uint32_t hash_body = 0x27d4eb2fu, hash_abstraction = 0x165667b1u;
+
+    // 関数部，引数部，本体の値から，節の値を求める一次式．
+    hash_map application_lhs_map(std::uint32_t rhs){
+        return hash_map{hash_lhs, hash_rhs * rhs + hash_application};
+    }
+
+    hash_map application_rhs_map(std::uint32_t lhs){
+        return hash_map{hash_rhs, hash_lhs * lhs + hash_application};
+    }
+
+    hash_map abstraction_map(){
+        return hash_map{hash_body, hash_abstraction};
+    }
+
+    // 節の構造の値を子の値から求める．子が無ければ0を渡す．
+    std::uint32_t term_hash(term::kind k, std::size_t value, std::uint32_t lhs, std::uint32_t rhs){
+        switch(k){
+        case term::kind::application:
+            return application_lhs_map(rhs)(lhs);
+
+        case term::kind::abstraction:
+            return abstraction_map()(lhs);
+
+        default:
+            {
+                std::uint64_t h = (static_cast<std::uint64_t>(value) << 1 | (k == term::kind::free ? 1 : 0)) + 0x9e3779b97f4a7c15ull;
+                h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+                h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+                return static_cast<std::uint32_t>(h ^ (h >> 31));
+            }
+        }
+    }
+
+    term_ref make_term(term::kind k, std::size_t value, term_ref lhs, term_ref rhs){
+        term *r = get_arena().allocate();
+        r->k = k;
+        r->canonical = false;
+        r->globals = false;
+        r->value = value;
+        r->lhs = lhs.detach();
+        r->rhs = rhs.detach();
+        r->hash = term_hash(k, value, r->lhs ? r->lhs->hash : 0, r->rhs ? r->rhs->hash : 0);
+        r->refs = 0;
+        switch(k){
+        case term::kind::bound:
+            r->loose = static_cast<std::uint32_t>(value + 1);
+            break;
+
+        case term::kind::free:
+            r->loose = 0;
+            break;
+
+        case term::kind::application:
+            r->loose = std::max(r->lhs->loose, r->rhs->loose);
+            break;
+
+        case term::kind::abstraction:
+            r->loose = r->lhs->loose > 0 ? r->lhs->loose - 1 : 0;
+            break;
+        }
+        return term_ref(r);
+    }
+
+    term_ref make_bound(std::size_t index){
+        return make_term(term::kind::bound, index, term_ref(), term_ref());
+    }
+
+    term_ref make_free(std::size_t symbol){
+        return make_term(term::kind::free, symbol, term_ref(), term_ref());
+    }
+
+    term_ref make_application(term_ref f, term_ref a){
+        return make_term(term::kind::application, 0, std::move(f), std::move(a));
+    }
+
+    term_ref make_abstraction(std::size_t symbol, term_ref body){
+        return make_term(term::kind::abstraction, symbol, std::move(body), term_ref());
+    }
+
+    // 子が変わらなければ元の節をそのまま共有する．
+    term_ref rebuild_application(const term *t, term_ref f, term_ref a){
+        if(f.get() == t->lhs && a.get() == t->rhs){
+            return term_ref(t);
+        }
+        return make_application(std::move(f), std::move(a));
+    }
+
+    term_ref rebuild_abstraction(const term *t, term_ref body){
+        if(body.get() == t->lhs){
+            return term_ref(t);
+        }
+        return make_abstraction(t->value, std::move(body));
+    }
+
+    // 再帰で辿る深さの上限．
+    // これより深い部分項は作業リストで辿り，ネイティブスタックの使用量を抑える．
+    const std::size_t recursion_limit = 1024;
+
+    // 項を作業リストで葉から組み直す．
+    // 子を組み直し終えた節は二度目に取り出したときに組み立てる．
+    template<class Leaf>
+    term_ref rewrite_deep(const term *t, std::size_t base, Leaf &leaf){
+        struct frame{
+            const term *t;
+            std::size_t depth;
+            bool done;
+        };
+
+        std::vector<frame> frames;
+        std::vector<term_ref> results;
+        frames.push_back(frame{t, base, false});
+        while(!frames.empty()){
+            frame f = frames.back();
+            frames.pop_back();
+            // base以上の指標を含まない部分項は変わらない．
+            if(!f.done && f.t->loose <= f.depth){
+                results.push_back(term_ref(f.t));
+                continue;
+            }
+            switch(f.t->get_kind()){
+            case term::kind::bound:
+            case term::kind::free:
+                results.push_back(leaf(f.t, f.depth));
+                break;
+
+            case term::kind::application:
+                if(f.done){
+                    term_ref a(std::move(results.back()));
+                    results.pop_back();
+                    results.back() = rebuild_application(f.t, std::move(results.back()), std::move(a));
+                }else{
+                    frames.push_back(frame{f.t, f.depth, true});
+                    frames.push_back(frame{f.t->rhs, f.depth, false});
+                    frames.push_back(frame{f.t->lhs, f.depth, false});
+                }
+                break;
+
+            case term::kind::abstraction:
+                if(f.done){
+                    results.back() = rebuild_abstraction(f.t, std::move(results.back()));
+                }else{
+                    frames.push_back(frame{f.t, f.depth, true});
+                    frames.push_back(frame{f.t->lhs, f.depth + 1, false});
+                }
+                break;
+            }
+        }
+        return std::move(results.back());
+    }
+
+    term_ref shift(const term *t, std::size_t d, std::size_t cutoff, std::size_t nest);
+
+    // shiftとsubstituteの葉での置き換え．
+    struct shift_leaf{
+        std::size_t d;
+
+        term_ref operator ()(const term *v, std::size_t cutoff) const{
+            if(v->get_kind() == term::kind::bound && v->value >= cutoff){
+                return make_bound(v->value + d);
+            }
+            return term_ref(v);
+        }
+    };
+
+    struct substitute_leaf{
+        const term_ref &a;
+
+        term_ref operator ()(const term *v, std::size_t depth) const{
+            if(v->get_kind() == term::kind::bound){
+                if(v->value == depth){
+                    return depth == 0 ? a : shift(a.get(), depth, 0, recursion_limit);
+                }else if(v->value > depth){
+                    return make_bound(v->value - 1);
+                }
+            }
+            return term_ref(v);
+        }
+    };
+
+    // cutoff以上の指標をdだけずらす．
+    // 浅い部分は再帰で辿り，nestを使い切ったら作業リストに切り替える．
+    // cutoff以上の指標を含まない部分項は辿らずに共有する．
+    term_ref shift(const term *t, std::size_t d, std::size_t cutoff, std::size_t nest){
+        if(t->loose <= cutoff){
+            return term_ref(t);
+        }
+        switch(t->get_kind()){
+        case term::kind::bound:
+            if(t->value >= cutoff){
+                return make_bound(t->value + d);
+            }
+            return term_ref(t);
+
+        case term::kind::free:
+            return term_ref(t);
+
+        case term::kind::application:
+            if(nest == 0){
+                shift_leaf leaf{d};
+                return rewrite_deep(t, cutoff, leaf);
+            }
+            return rebuild_application(t, shift(t->lhs, d, cutoff, nest - 1), shift(t->rhs, d, cutoff, nest - 1));
+
+        case term::kind::abstraction:
+            if(nest == 0){
+                shift_leaf leaf{d};
+                return rewrite_deep(t, cutoff, leaf);
+            }
+            return rebuild_abstraction(t, shift(t->lhs, d, cutoff + 1, nest - 1));
+        }
+
+        // unreached point.
+        return term_ref();
+    }
+
+    term_ref shift(const term *t, std::size_t d, std::size_t cutoff){
+        return shift(t, d, cutoff, recursion_limit);
+    }
+
+    // 本体tの指標depthをaで置き換え，それより外側の指標を一つ詰める．
+    // 置き換えの起きない部分項と引数は複製せず共有する．depth以上の指標を含まない部分項は辿らない．
+    term_ref substitute(const term *t, const term_ref &a, std::size_t depth, std::size_t nest){
+        if(t->loose <= depth){
+            return term_ref(t);
+        }
+        switch(t->get_kind()){
+        case term::kind::bound:
+            if(t->value == depth){
+                return depth == 0 ? a : shift(a.get(), depth, 0);
+            }else if(t->value > depth){
+                return make_bound(t->value - 1);
+            }else{
+                return term_ref(t);
+            }
+
+        case term::kind::free:
+            return term_ref(t);
+
+        case term::kind::application:
+            if(nest == 0){
+                substitute_leaf leaf{a};
+                return rewrite_deep(t, depth, leaf);
+            }
+            return rebuild_application(t, substitute(t->lhs, a, depth, nest - 1), substitute(t->rhs, a, depth, nest - 1));
+
+        case term::kind::abstraction:
+            if(nest == 0){
+                substitute_leaf leaf{a};
+                return rewrite_deep(t, depth, leaf);
+            }
+            return rebuild_abstraction(t, substitute(t->lhs, a, depth + 1, nest - 1));
+        }
+
+        // unreached point.
+        return term_ref();
+    }
+
+    term_ref substitute(const term *t, const term_ref &a, std::size_t depth){
+        return substitute(t, a, depth, recursion_limit);
+    }
+
+    // 代入式の右辺．記号番号で引く．
+    std::vector<term_ref> definitions;
+
+    const term *find_definition(std::size_t symbol){
+        return symbol < definitions.size() ? definitions[symbol].get() : nullptr;
+    }
+
+    // 代入式の右辺に現れる束縛変数名か．記号番号で引く．
+    std::vector<bool> definition_binders;
+
+    // 代入式の右辺を正規形にしてから展開するか．
+    bool cache_definitions = false;
+
+    // 正規化した代入式の右辺．記号番号で引き，まだ求めていなければnullptr．
+    // 求め終えた値は読むだけなので，並列に評価していてもロックせずに引ける．
+    // 書き込むときとdefinition_arenaへ写すときだけnormal_definitions_mutexでロックする．
+    std::vector<std::unique_ptr<std::atomic<const term*>>> normal_definitions;
+    std::mutex normal_definitions_mutex;
+
+    // 項の節を全て固定する．
+    void pin(const term *t){
+        std::vector<const term*> work;
+        work.push_back(t);
+        while(!work.empty()){
+            t = work.back();
+            work.pop_back();
+            if(t && t->refs != pinned_refs){
+                t->refs = pinned_refs;
+                work.push_back(t->lhs);
+                work.push_back(t->rhs);
+            }
+        }
+    }
+
+    // 項を現在の確保領域へ写す．共有は保ち，固定された節は写さない．
+    // 子を写し終えた節は二度目に取り出したときに組み立てる．
+    term_ref import(const term *t, std::map<const term*, term_ref> &memo){
+        struct frame{
+            const term *t;
+            bool done;
+        };
+
+        std::vector<frame> frames;
+        std::vector<term_ref> results;
+        frames.push_back(frame{t, false});
+        while(!frames.empty()){
+            frame f = frames.back();
+            frames.pop_back();
+            if(!f.done){
+                if(f.t->refs == pinned_refs){
+                    results.push_back(term_ref(f.t));
+                    continue;
+                }
+                auto iter = memo.find(f.t);
+                if(iter != memo.end()){
+                    results.push_back(iter->second);
+                    continue;
+                }
+            }
+            switch(f.t->get_kind()){
+            case term::kind::bound:
+                results.push_back(make_bound(f.t->value));
+                break;
+
+            case term::kind::free:
+                results.push_back(make_free(f.t->value));
+                break;
+
+            case term::kind::application:
+                if(f.done){
+                    term_ref rhs(std::move(results.back()));
+                    results.pop_back();
+                    results.back() = make_application(std::move(results.back()), std::move(rhs));
+                }else{
+                    frames.push_back(frame{f.t, true});
+                    frames.push_back(frame{f.t->rhs, false});
+                    frames.push_back(frame{f.t->lhs, false});
+                    continue;
+                }
+                break;
+
+            case term::kind::abstraction:
+                if(f.done){
+                    results.back() = make_abstraction(f.t->value, std::move(results.back()));
+                }else{
+                    frames.push_back(frame{f.t, true});
+                    frames.push_back(frame{f.t->lhs, false});
+                    continue;
+                }
+                break;
+            }
+            memo.insert(std::make_pair(f.t, results.back()));
+        }
+        return std::move(results.back());
+    }
+
+    // 二つの項がα同値か調べる．
+    bool same_term(const term *a, const term *b){
+        std::vector<std::pair<const term*, const term*>> work;
+        std::set<std::pair<const term*, const term*>> visited;
+        work.push_back(std::make_pair(a, b));
+        while(!work.empty()){
+            a = work.back().first;
+            b = work.back().second;
+            work.pop_back();
+            if(a == b){
+                continue;
+            }
+            if(a->hash != b->hash || a->get_kind() != b->get_kind() || (a->get_kind() != term::kind::abstraction && a->value != b->value)){
+                return false;
+            }
+            // 共有された部分項を何度も比べないようにする．
+            if(!visited.insert(std::make_pair(a, b)).second){
+                continue;
+            }
+            if(a->lhs){
+                work.push_back(std::make_pair(a->lhs, b->lhs));
+            }
+            if(a->rhs){
+                work.push_back(std::make_pair(a->rhs, b->rhs));
+            }
+        }
+        return true;
+    }
+
+    // 正規形の表．
+    // 簡約した部分項と正規形の組を，同じ項を一つの節にまとめて(hash-consing)専用の確保領域に置く．
+    // 全ての行とスレッドで共有し，ロックして使う．
+    // de Bruijn指標で表した項の正規形は外側の文脈によらないので，自由な指標を含む部分項もそのまま引ける．
+    // 束縛変数名が違うだけの項も引けるように，正規形の束縛変数名は引いた項の名前へ付け替えて返す．
+    class normal_form_memo{
+    public:
+        // tとα同値な項の正規形を探す．見つからなければnullptr．
+        // 正規形の束縛変数名は，tを表を使わずに簡約したときと同じになる．
+        const term *find(const term *t){
+            std::lock_guard<std::mutex> lock(mutex);
+            auto range = normal_forms.equal_range(t->hash);
+            for(auto iter = range.first; iter != range.second; ++iter){
+                std::map<std::size_t, std::size_t> renames;
+                std::vector<const term*> shared;
+                if(!match(t, iter->second.first, renames, shared)){
+                    continue;
+                }
+                bool same = true;
+                for(auto &i : renames){
+                    same = same && i.first == i.second;
+                }
+                if(same){
+                    return iter->second.second;
+                }
+                arena_switch s(arena);
+                term_ref nf = rename(iter->second.second, shared, renames);
+                if(nf){
+                    return add(intern(t), intern(nf.get()));
+                }
+            }
+            return nullptr;
+        }
+
+        // tの正規形nfを登録し，nfの代表の節を返す．
+        const term *insert(const term *t, const term *nf){
+            std::lock_guard<std::mutex> lock(mutex);
+            arena_switch s(arena);
+            return add(intern(t), intern(nf));
+        }
+
+        // 代入式が変わったら，表の正規形は使えなくなる．
+        void clear(){
+            std::lock_guard<std::mutex> lock(mutex);
+            normal_forms.clear();
+            unique.clear();
+            arena.release();
+        }
+
+    private:
+        const term *add(const term *key, const term *value){
+            auto range = normal_forms.equal_range(key->hash);
+            for(auto iter = range.first; iter != range.second; ++iter){
+                if(iter->second.first == key){
+                    return iter->second.second;
+                }
+            }
+            normal_forms.insert(std::make_pair(key->hash, std::make_pair(key, value)));
+            return value;
+        }
+
+        // tとkeyがα同値なら，keyの束縛変数名からtの束縛変数名への対応をrenamesに集める．
+        // 一つの名前を二つの名前へ対応させることになれば，付け替えられないので一致しないものとする．
+        // tとkeyで共有している節はsharedに集め，その中の名前はそのまま対応させる．
+        static bool match(const term *t, const term *key, std::map<std::size_t, std::size_t> &renames, std::vector<const term*> &shared){
+            std::vector<std::pair<const term*, const term*>> work;
+            std::set<std::pair<const term*, const term*>> visited;
+            work.push_back(std::make_pair(t, key));
+            while(!work.empty()){
+                const term *a = work.back().first, *b = work.back().second;
+                work.pop_back();
+                if(a == b){
+                    shared.push_back(a);
+                    continue;
+                }
+                if(a->hash != b->hash || a->get_kind() != b->get_kind() || (a->get_kind() != term::kind::abstraction && a->value != b->value)){
+                    return false;
+                }
+                if(!visited.insert(std::make_pair(a, b)).second){
+                    continue;
+                }
+                if(a->get_kind() == term::kind::abstraction){
+                    auto r = renames.insert(std::make_pair(b->value, a->value));
+                    if(r.first->second != a->value){
+                        return false;
+                    }
+                }
+                if(a->lhs){
+                    work.push_back(std::make_pair(a->lhs, b->lhs));
+                }
+                if(a->rhs){
+                    work.push_back(std::make_pair(a->rhs, b->rhs));
+                }
+            }
+            return true;
+        }
+
+        // 正規形nfの束縛変数名をrenamesに従って付け替えた項を現在の確保領域に作る．
+        // nfの束縛変数は，表に登録した項の抽象か代入式の右辺の抽象から写されたものである．
+        // 付け替える名前が代入式の右辺にも現れるとどちらから来たか分からないので，付け替えずにnullptrを返す．
+        // 共有している節の中に付け替える名前が現れるときも同じ．
+        static term_ref rename(const term *nf, const std::vector<const term*> &shared, const std::map<std::size_t, std::size_t> &renames){
+            struct frame{
+                const term *t;
+                bool done;
+            };
+
+            auto renamed = [&](std::size_t symbol){
+                auto r = renames.find(symbol);
+                return r != renames.end() && r->second != symbol;
+            };
+            std::set<const term*> seen;
+            std::vector<const term*> work(shared);
+            while(!work.empty()){
+                const term *t = work.back();
+                work.pop_back();
+                if(!seen.insert(t).second){
+                    continue;
+                }
+                if(t->get_kind() == term::kind::abstraction && renamed(t->value)){
+                    return term_ref();
+                }
+                if(t->lhs){
+                    work.push_back(t->lhs);
+                }
+                if(t->rhs){
+                    work.push_back(t->rhs);
+                }
+            }
+
+            std::unordered_map<const term*, term_ref> memo;
+            std::vector<frame> frames;
+            std::vector<term_ref> results;
+            frames.push_back(frame{nf, false});
+            while(!frames.empty()){
+                frame f = frames.back();
+                frames.pop_back();
+                auto m = memo.find(f.t);
+                if(m != memo.end()){
+                    results.push_back(m->second);
+                    continue;
+                }
+                switch(f.t->get_kind()){
+                case term::kind::bound:
+                case term::kind::free:
+                    results.push_back(term_ref(f.t));
+                    break;
+
+                case term::kind::application:
+                    if(f.done){
+                        term_ref rhs(std::move(results.back()));
+                        results.pop_back();
+                        results.back() = make_application(std::move(results.back()), std::move(rhs));
+                    }else{
+                        frames.push_back(frame{f.t, true});
+                        frames.push_back(frame{f.t->rhs, false});
+                        frames.push_back(frame{f.t->lhs, false});
+                        continue;
+                    }
+                    break;
+
+                case term::kind::abstraction:
+                    if(f.done){
+                        std::size_t symbol = f.t->value;
+                        if(renamed(symbol)){
+                            if(symbol < definition_binders.size() && definition_binders[symbol]){
+                                return term_ref();
+                            }
+                            symbol = renames.find(symbol)->second;
+                        }
+                        results.back() = make_abstraction(symbol, std::move(results.back()));
+                    }else{
+                        frames.push_back(frame{f.t, true});
+                        frames.push_back(frame{f.t->lhs, false});
+                        continue;
+                    }
+                    break;
+                }
+                memo.insert(std::make_pair(f.t, results.back()));
+            }
+            return std::move(results.back());
+        }
+
+        // tと束縛変数名まで等しい代表の節を返す．無ければ作る．
+        // 子を代表に置き換え終えた節は二度目に取り出したときに引く．
+        const term *intern(const term *t){
+            struct frame{
+                const term *t;
+                bool done;
+            };
+
+            std::unordered_map<const term*, const term*> visited;
+            std::vector<frame> frames;
+            std::vector<const term*> results;
+            frames.push_back(frame{t, false});
+            while(!frames.empty()){
+                frame f = frames.back();
+                frames.pop_back();
+                if(f.t->canonical){
+                    results.push_back(f.t);
+                    continue;
+                }
+                auto v = visited.find(f.t);
+                if(v != visited.end()){
+                    results.push_back(v->second);
+                    continue;
+                }
+                if(!f.done){
+                    frames.push_back(frame{f.t, true});
+                    if(f.t->rhs){
+                        frames.push_back(frame{f.t->rhs, false});
+                    }
+                    if(f.t->lhs){
+                        frames.push_back(frame{f.t->lhs, false});
+                    }
+                    continue;
+                }
+
+                const term *rhs = nullptr, *lhs = nullptr;
+                if(f.t->rhs){
+                    rhs = results.back();
+                    results.pop_back();
+                }
+                if(f.t->lhs){
+                    lhs = results.back();
+                    results.pop_back();
+                }
+                const term *r = nullptr;
+                auto range = unique.equal_range(f.t->hash);
+                for(auto iter = range.first; iter != range.second; ++iter){
+                    const term *u = iter->second;
+                    if(u->get_kind() == f.t->get_kind() && u->lhs == lhs && u->rhs == rhs && u->value == f.t->value){
+                        r = u;
+                        break;
+                    }
+                }
+                if(!r){
+                    term_ref n = make_term(f.t->get_kind(), f.t->value, term_ref(lhs), term_ref(rhs));
+                    term *m = const_cast<term*>(n.get());
+                    m->canonical = true;
+                    m->globals = (m->get_kind() == term::kind::free && find_definition(m->value)) || (lhs && lhs->globals) || (rhs && rhs->globals);
+                    m->refs = pinned_refs;
+                    r = m;
+                    unique.insert(std::make_pair(r->hash, r));
+                }
+                visited[f.t] = r;
+                results.push_back(r);
+            }
+            return results.back();
+        }
+
+        term_arena arena;
+        std::unordered_multimap<std::uint32_t, const term*> unique;
+        std::unordered_multimap<std::uint32_t, std::pair<const term*, const term*>> normal_forms;
+        std::mutex mutex;
+    };
+
+    // 簡約で正規形の表を使うか．
+    bool use_memo = false;
+
+    normal_form_memo memo_table;
+
+    // 名前付きの式を名前なしの項へ変換する．
+    // contextは外側から順に並んだ束縛変数の記号番号．
+    // 子を変換し終えた式は二度目に取り出したときに組み立てる．
+    term_ref lower(const internal_data::expr *e, std::vector<std::size_t> &context){
+        struct frame{
+            const internal_data::expr *e;
+            bool done;
+        };
+
+        std::vector<frame> frames;
+        std::vector<term_ref> results;
+        frames.push_back(frame{e, false});
+        while(!frames.empty()){
+            frame f = frames.back();
+            frames.pop_back();
+            if(f.e->get_kind() == internal_data::expr::kind::variable){
+                std::size_t symbol = symbols.intern(static_cast<const internal_data::variable*>(f.e)->str);
+                std::size_t i = 0;
+                for(; i < context.size(); ++i){
+                    if(context[context.size() - 1 - i] == symbol){
+                        break;
+                    }
+                }
+                results.push_back(i < context.size() ? make_bound(i) : make_free(symbol));
+            }else if(f.e->get_kind() == internal_data::expr::kind::sequence){
+                const internal_data::sequence *seq = static_cast<const internal_data::sequence*>(f.e);
+                if(f.done){
+                    auto first = results.end() - seq->vec.size();
+                    term_ref r(std::move(*first));
+                    for(auto iter = first + 1; iter != results.end(); ++iter){
+                        r = make_application(std::move(r), std::move(*iter));
+                    }
+                    results.erase(first, results.end());
+                    results.push_back(std::move(r));
+                }else{
+                    frames.push_back(frame{f.e, true});
+                    for(auto iter = seq->vec.rbegin(); iter != seq->vec.rend(); ++iter){
+                        frames.push_back(frame{iter->get(), false});
+                    }
+                }
+            }else{
+                const internal_data::lambda *lam = static_cast<const internal_data::lambda*>(f.e);
+                if(f.done){
+                    term_ref r(std::move(results.back()));
+                    for(std::size_t i = 0; i < lam->variable_seq.size(); ++i){
+                        r = make_abstraction(context.back(), std::move(r));
+                        context.pop_back();
+                    }
+                    results.back() = std::move(r);
+                }else{
+                    for(auto &i : lam->variable_seq){
+                        context.push_back(symbols.intern(i.str));
+                    }
+                    frames.push_back(frame{f.e, true});
+                    frames.push_back(frame{lam->seq.get(), false});
+                }
+            }
+        }
+        return std::move(results.back());
+    }
+
+    term_ref lower(const internal_data::expr *e){
+        std::vector<std::size_t> context;
+        return lower(e, context);
+    }
+
+    // 新しく加わった代入式を名前なしの項へ変換する．代入式が増えたらtrueを返す．
+    bool lower_assignments(){
+        arena_switch s(definition_arena);
+        bool added = false;
+        for(auto &i : internal_data::pending_assignments){
+            std::size_t symbol = symbols.intern(i->first);
+            if(definitions.size() <= symbol){
+                definitions.resize(symbol + 1);
+            }
+            if(!definitions[symbol]){
+                definitions[symbol] = lower(i->second.get());
+                pin(definitions[symbol].get());
+                std::vector<const term*> work(1, definitions[symbol].get());
+                while(!work.empty()){
+                    const term *t = work.back();
+                    work.pop_back();
+                    if(t->get_kind() == term::kind::abstraction){
+                        if(definition_binders.size() <= t->value){
+                            definition_binders.resize(t->value + 1);
+                        }
+                        definition_binders[t->value] = true;
+                    }
+                    if(t->lhs){
+                        work.push_back(t->lhs);
+                    }
+                    if(t->rhs){
+                        work.push_back(t->rhs);
+                    }
+                }
+                added = true;
+            }
+        }
+        internal_data::pending_assignments.clear();
+        if(added){
+            memo_table.clear();
+        }
+        while(normal_definitions.size() < definitions.size()){
+            normal_definitions.emplace_back(new std::atomic<const term*>(nullptr));
+        }
+        return added;
+    }
+
+    // 式に現れる名前を全て記号表へ登録する．
+    // 並列に評価する前に済ませておけば，評価中の記号表は読むだけになる．
+    void intern_symbols(const internal_data::expr *e){
+        std::vector<const internal_data::expr*> work;
+        work.push_back(e);
+        while(!work.empty()){
+            e = work.back();
+            work.pop_back();
+            if(e->get_kind() == internal_data::expr::kind::variable){
+                symbols.intern(static_cast<const internal_data::variable*>(e)->str);
+            }else if(e->get_kind() == internal_data::expr::kind::sequence){
+                for(auto &i : static_cast<const internal_data::sequence*>(e)->vec){
+                    work.push_back(i.get());
+                }
+            }else{
+                const internal_data::lambda *lam = static_cast<const internal_data::lambda*>(e);
+                for(auto &i : lam->variable_seq){
+                    symbols.intern(i.str);
+                }
+                work.push_back(lam->seq.get());
+            }
+        }
+    }
+
+    // 項の中に名前strで表示される外側の束縛変数か自由変数が現れるか調べる．
+    bool mentions(const term *t, std::size_t depth, const std::vector<std::string> &context, const std::string &str){
+        std::vector<std::pair<const term*, std::size_t>> work;
+        work.push_back(std::make_pair(t, depth));
+        while(!work.empty()){
+            t = work.back().first;
+            depth = work.back().second;
+            work.pop_back();
+            switch(t->get_kind()){
+            case term::kind::bound:
+                if(t->value >= depth && context[context.size() - 1 - (t->value - depth)] == str){
+                    return true;
+                }
+                break;
+
+            case term::kind::free:
+                if(symbols.name(t->value) == str){
+                    return true;
+                }
+                break;
+
+            case term::kind::application:
+                work.push_back(std::make_pair(t->rhs, depth));
+                work.push_back(std::make_pair(t->lhs, depth));
+                break;
+
+            case term::kind::abstraction:
+                work.push_back(std::make_pair(t->lhs, depth + 1));
+                break;
+            }
+        }
+        return false;
+    }
+
+    // 名前なしの項を名前付きの式へ戻す．
+    // 束縛変数名が捕獲を起こす場合は"'"を付け足して区別する．
+    // 式は根から作り，子の式を書き込む先を作業リストに積む．
+    // 抽象の本体を書き終えたら束縛変数名を外すため，外す数だけを持つ項目も積む．
+    std::unique_ptr<internal_data::expr> readback(const term *t, std::vector<std::string> &context){
+        struct item{
+            const term *t;
+            std::unique_ptr<internal_data::expr> *dst;
+            std::size_t pop;
+        };
+
+        std::unique_ptr<internal_data::expr> r;
+        std::vector<item> work;
+        work.push_back(item{t, &r, 0});
+        while(!work.empty()){
+            item i = work.back();
+            work.pop_back();
+            if(!i.t){
+                context.resize(context.size() - i.pop);
+                continue;
+            }
+            t = i.t;
+            switch(t->get_kind()){
+            case term::kind::bound:
+                {
+                    internal_data::variable *var = new internal_data::variable;
+                    var->str = context[context.size() - 1 - t->value];
+                    i.dst->reset(var);
+                }
+                break;
+
+            case term::kind::free:
+                {
+                    internal_data::variable *var = new internal_data::variable;
+                    var->str = symbols.name(t->value);
+                    i.dst->reset(var);
+                }
+                break;
+
+            case term::kind::application:
+                {
+                    internal_data::sequence *seq = new internal_data::sequence;
+                    i.dst->reset(seq);
+                    std::size_t n = 1;
+                    for(const term *s = t; s->get_kind() == term::kind::application; s = s->lhs){
+                        ++n;
+                    }
+                    seq->vec.resize(n);
+                    for(; t->get_kind() == term::kind::application; t = t->lhs){
+                        work.push_back(item{t->rhs, &seq->vec[--n], 0});
+                    }
+                    work.push_back(item{t, &seq->vec[0], 0});
+                }
+                break;
+
+            case term::kind::abstraction:
+                {
+                    internal_data::lambda *lam = new internal_data::lambda;
+                    i.dst->reset(lam);
+                    std::size_t n = 0;
+                    for(; t->get_kind() == term::kind::abstraction; t = t->lhs, ++n){
+                        std::string str = symbols.name(t->value);
+                        while(mentions(t->lhs, 1, context, str)){
+                            str += "'";
+                        }
+                        internal_data::variable v;
+                        v.str = str;
+                        lam->variable_seq.push_back(v);
+                        context.push_back(str);
+                    }
+                    work.push_back(item{nullptr, nullptr, n});
+                    if(t->get_kind() == term::kind::application){
+                        work.push_back(item{t, &lam->seq, 0});
+                    }else{
+                        lam->get_seq()->vec.resize(1);
+                        work.push_back(item{t, &lam->get_seq()->vec[0], 0});
+                    }
+                }
+                break;
+            }
+        }
+        return r;
+    }
+
+    std::unique_ptr<internal_data::expr> readback(const term *t){
+        std::vector<std::string> context;
+        return readback(t, context);
+    }
+
+    // 名前なしの項を，名前付きの式に戻して文字列にしたものと同じ表記でoutへ直接書き出す．
+    // 名前付きの式も文字列も作らず，一度の走査で書き出す．
+    // 束縛変数名が項全体の自由変数名とも本体から参照できる外側の束縛変数名とも違えば捕獲は起きないので，
+    // そのときはmentionsで本体を辿らずに決める．
+    // limitは書き出す変数名と束縛変数名の数の上限で，超えたら"..."を書いて打ち切りfalseを返す．0なら制限しない．
+    // namesに載っている節は，根でなければ部分項の代わりにその名前を書く．
+    bool print(std::ostream &out, const term *t, std::size_t limit, const std::map<const term*, std::string> *names = nullptr){
+        const term *root = t;
+        struct item{
+            const term *t;
+            const char *text;
+            std::size_t pop;
+        };
+
+        // 項全体に現れる自由変数名．共有された節は一度だけ辿る．
+        std::set<std::string> free_names;
+        {
+            std::set<const term*> visited;
+            std::vector<const term*> work;
+            work.push_back(t);
+            while(!work.empty()){
+                const term *s = work.back();
+                work.pop_back();
+                if(s->refs > 1 && !visited.insert(s).second){
+                    continue;
+                }
+                switch(s->get_kind()){
+                case term::kind::bound:
+                    break;
+
+                case term::kind::free:
+                    free_names.insert(symbols.name(s->value));
+                    break;
+
+                case term::kind::application:
+                    work.push_back(s->rhs);
+                    work.push_back(s->lhs);
+                    break;
+
+                case term::kind::abstraction:
+                    work.push_back(s->lhs);
+                    break;
+                }
+            }
+        }
+
+        // 名前で書く節か．
+        auto named = [&](const term *s){
+            return names && s != root && names->count(s);
+        };
+
+        // 外側の束縛変数名と，その名前の束縛変数の数．
+        std::vector<std::string> context;
+        std::map<std::string, std::size_t> scope;
+
+        // 抽象の本体bodyで名前strが外側の変数を指すことがあり得るか．
+        // 本体から参照できる外側の束縛変数は，内側からloose - 1個までに限られる．
+        auto may_capture = [&](const term *body, const std::string &str){
+            if(free_names.count(str)){
+                return true;
+            }
+            if(!scope.count(str)){
+                return false;
+            }
+            for(std::size_t n = 1; n < body->loose; ++n){
+                if(context[context.size() - n] == str){
+                    return true;
+                }
+            }
+            return false;
+        };
+        std::size_t count = 0;
+        std::vector<item> work;
+        work.push_back(item{t, nullptr, 0});
+        while(!work.empty()){
+            item i = work.back();
+            work.pop_back();
+            if(!i.t){
+                if(i.text){
+                    out << i.text;
+                }
+                for(std::size_t n = 0; n < i.pop; ++n){
+                    auto iter = scope.find(context.back());
+                    if(--iter->second == 0){
+                        scope.erase(iter);
+                    }
+                    context.pop_back();
+                }
+                continue;
+            }
+            t = i.t;
+            if(named(t)){
+                if(limit && count++ == limit){
+                    out << "...";
+                    return false;
+                }
+                out << names->find(t)->second;
+                continue;
+            }
+            switch(t->get_kind()){
+            case term::kind::bound:
+            case term::kind::free:
+                if(limit && count++ == limit){
+                    out << "...";
+                    return false;
+                }
+                out << (t->get_kind() == term::kind::bound ? context[context.size() - 1 - t->value] : symbols.name(t->value));
+                break;
+
+            case term::kind::application:
+                for(; t->get_kind() == term::kind::application && (t == i.t || !named(t)); t = t->lhs){
+                    bool nest = t->rhs->get_kind() != term::kind::bound && t->rhs->get_kind() != term::kind::free && !named(t->rhs);
+                    if(nest){
+                        work.push_back(item{nullptr, ")", 0});
+                    }
+                    work.push_back(item{t->rhs, nullptr, 0});
+                    if(nest){
+                        work.push_back(item{nullptr, "(", 0});
+                    }
+                    work.push_back(item{nullptr, " ", 0});
+                }
+                if(t->get_kind() == term::kind::abstraction && !named(t)){
+                    work.push_back(item{nullptr, ")", 0});
+                    work.push_back(item{t, nullptr, 0});
+                    work.push_back(item{nullptr, "(", 0});
+                }else{
+                    work.push_back(item{t, nullptr, 0});
+                }
+                break;
+
+            case term::kind::abstraction:
+                {
+                    out << "/";
+                    std::size_t n = 0;
+                    for(; t->get_kind() == term::kind::abstraction && (n == 0 || !named(t)); t = t->lhs, ++n){
+                        std::string str = symbols.name(t->value);
+                        while(may_capture(t->lhs, str) && mentions(t->lhs, 1, context, str)){
+                            str += "'";
+                        }
+                        if(n > 0){
+                            out << " ";
+                        }
+                        if(limit && count++ == limit){
+                            out << "...";
+                            return false;
+                        }
+                        out << str;
+                        ++scope[str];
+                        context.push_back(std::move(str));
+                    }
+                    out << ". ";
+                    work.push_back(item{nullptr, nullptr, n});
+                    work.push_back(item{t, nullptr, 0});
+                }
+                break;
+            }
+        }
+        return true;
+    }
+
+    // 書き出すと二度以上現れる閉じた部分項を，α同値なものごとに一つの代入式へまとめる．
+    // 部分項の節には構造だけで決まる類の番号を，子の類より大きくなるように振る．
+    // 根に近い類から順に書き出す回数を数え，代入式にまとめた類の中身は一度しか書き出さないものとして子へ伝える．
+    // まとめた類の全ての節をnamesにprefixと番号を付けた名前で載せ，代入式の右辺にする節を依存する順に返す．
+    std::vector<const term*> share(const term *t, const std::string &prefix, std::map<const term*, std::string> &names){
+        static const std::size_t none = std::numeric_limits<std::size_t>::max();
+
+        struct frame{
+            const term *t;
+            bool done;
+        };
+
+        struct term_class{
+            const term *t;
+            std::size_t lhs, rhs;
+        };
+
+        std::unordered_map<const term*, std::size_t> class_of;
+        std::map<std::tuple<term::kind, std::size_t, std::size_t, std::size_t>, std::size_t> unique;
+        std::vector<term_class> classes;
+        std::vector<frame> frames;
+        frames.push_back(frame{t, false});
+        while(!frames.empty()){
+            frame f = frames.back();
+            frames.pop_back();
+            if(class_of.count(f.t)){
+                continue;
+            }
+            if(!f.done){
+                frames.push_back(frame{f.t, true});
+                if(f.t->rhs){
+                    frames.push_back(frame{f.t->rhs, false});
+                }
+                if(f.t->lhs){
+                    frames.push_back(frame{f.t->lhs, false});
+                }
+                continue;
+            }
+            std::size_t lhs = f.t->lhs ? class_of[f.t->lhs] : none;
+            std::size_t rhs = f.t->rhs ? class_of[f.t->rhs] : none;
+            std::size_t value = f.t->get_kind() == term::kind::abstraction ? 0 : f.t->value;
+            auto iter = unique.insert(std::make_pair(std::make_tuple(f.t->get_kind(), value, lhs, rhs), classes.size())).first;
+            if(iter->second == classes.size()){
+                classes.push_back(term_class{f.t, lhs, rhs});
+            }
+            class_of[f.t] = iter->second;
+        }
+
+        // 書き出す回数は2で打ち止めにする．
+        std::vector<unsigned char> count(classes.size(), 0);
+        std::vector<bool> shared(classes.size(), false);
+        count[class_of[t]] = 1;
+        for(std::size_t n = classes.size(); n-- > 0; ){
+            const term *u = classes[n].t;
+            shared[n] = count[n] >= 2 && u->loose == 0 && u->get_kind() != term::kind::bound && u->get_kind() != term::kind::free;
+            unsigned char c = shared[n] ? 1 : count[n];
+            for(std::size_t child : {classes[n].lhs, classes[n].rhs}){
+                if(child != none){
+                    count[child] = static_cast<unsigned char>(std::min(2, count[child] + c));
+                }
+            }
+        }
+
+        std::vector<std::string> class_names(classes.size());
+        std::vector<const term*> r;
+        for(std::size_t n = 0; n < classes.size(); ++n){
+            if(shared[n]){
+                r.push_back(classes[n].t);
+                class_names[n] = prefix + std::to_string(r.size());
+                while(symbols.ids.count(class_names[n])){
+                    class_names[n] += "_";
+                }
+            }
+        }
+        for(auto &i : class_of){
+            if(shared[i.second]){
+                names[i.first] = class_names[i.second];
+            }
+        }
+        return r;
+    }
+
+    // 代入式の右辺を正規化する段数の上限．
+    // これを使い切った代入式は正規形が無いものとして，右辺をそのまま展開する．
+    const std::size_t definition_budget = 10000;
+
+    void publish_definition(std::size_t symbol, const term *nf);
+
+    // 簡約を進めた結果．
+    enum class step_status{
+        // 一段簡約した．
+        progressed,
+        // 展開する代入式の右辺を一段簡約したか，右辺の正規化を始めた．項全体は変わらない．
+        definition,
+        // 正規形に達した．頭部正規形で止める走査子では頭部正規形に達した．
+        normal_form,
+        // 正規形に達する前に段数の上限を使い切った．
+        budget_exhausted
+    };
+
+    // 最左最外簡約を一段ずつ進める．
+    // 根から注目している部分項までの道筋を保ったまま次の簡約基を探し，一段ごとに根から辿り直さない．
+    // 注目している部分項より左は正規形なので，簡約した位置から探索を続ければよい．
+    // 代入式の左辺は関数部に現れたときだけ右辺へ展開し，作業中の項を小さく保つ．
+    // 他の位置に残った左辺は，それ以外が正規形になってから根から辿り直して展開する．
+    // memoなら，独立に正規化される部分項(根，抽象の本体，頭部が変数の関数適用の引数)の正規形を正規形の表で引き，表へ登録する．
+    // headなら頭部正規形に達したところで止め，引数部は調べない．頭部に現れた代入式の左辺はその場で展開する．
+    // cache_definitionsなら，まだ正規化していない代入式を展開する前にその右辺を正規化する．
+    // 右辺の正規化も項の簡約の一段として数えるので，段数と資源の上限はそのまま右辺にも及ぶ．
+    class reduction_cursor{
+    public:
+        explicit reduction_cursor(term_ref t, bool memo = false, bool head = false) : focus(std::move(t)), normal(false), deferred(false), expand_all(head), memo(memo), head(head), owner(nullptr), dirty(0), steps(0){
+            if(memo){
+                root.start = focus;
+                enter(root);
+            }
+        }
+
+        // 最左最外の簡約基を一つ簡約する．
+        step_status step(){
+            if(!definitions.empty() && step_definition()){
+                return step_status::definition;
+            }
+            while(true){
+                if(normal){
+                    if(path.empty()){
+                        leave(root);
+                        if(deferred && !expand_all){
+                            expand_all = true;
+                            normal = false;
+                            continue;
+                        }
+                        return step_status::normal_form;
+                    }
+                    frame &f = path.back();
+                    if(f.k == term::kind::application && !f.rhs){
+                        if(head){
+                            return step_status::normal_form;
+                        }
+                        // 関数部が正規形になったので引数部を調べる．
+                        std::swap(focus, f.other);
+                        f.rhs = true;
+                        compose();
+                        normal = false;
+                        enter(f);
+                    }else{
+                        up();
+                    }
+                    continue;
+                }
+
+                const term *c = focus.get();
+                switch(c->get_kind()){
+                case term::kind::bound:
+                    normal = true;
+                    break;
+
+                case term::kind::free:
+                    if(find_definition(c->value)){
+                        if(expand_all){
+                            const term *def = unfold(c->value);
+                            if(!def){
+                                return step_status::definition;
+                            }
+                            focus = term_ref(def);
+                            contracted();
+                            return step_status::progressed;
+                        }
+                        deferred = true;
+                    }
+                    normal = true;
+                    break;
+
+                case term::kind::application:
+                    if(c->lhs->get_kind() == term::kind::abstraction){
+                        focus = substitute(c->lhs->lhs, term_ref(c->rhs), 0);
+                        contracted();
+                        return step_status::progressed;
+                    }
+                    if(c->lhs->get_kind() == term::kind::free && find_definition(c->lhs->value)){
+                        const term *def = unfold(c->lhs->value);
+                        if(!def){
+                            return step_status::definition;
+                        }
+                        focus = make_application(term_ref(def), term_ref(c->rhs));
+                        contracted();
+                        return step_status::progressed;
+                    }
+                    path.push_back(frame{term::kind::application, 0, term_ref(c->rhs), false, focus, term_ref(), hash_map{1, 0}});
+                    compose();
+                    focus = term_ref(c->lhs);
+                    break;
+
+                case term::kind::abstraction:
+                    path.push_back(frame{term::kind::abstraction, c->value, term_ref(), false, focus, term_ref(), hash_map{1, 0}});
+                    compose();
+                    focus = term_ref(c->lhs);
+                    enter(path.back());
+                    break;
+                }
+            }
+        }
+
+        // 正規形に達するか，budget段簡約するまで進める．代入式の右辺の一段も一段と数える．
+        step_status run(std::size_t budget = std::numeric_limits<std::size_t>::max()){
+            for(std::size_t i = 0; i < budget; ++i){
+                if(step() == step_status::normal_form){
+                    return step_status::normal_form;
+                }
+            }
+            return step_status::budget_exhausted;
+        }
+
+        // これまでに簡約した段数．
+        std::size_t get_steps() const{
+            return steps;
+        }
+
+        // 項全体を組み立てるときに新しく作る節の数．
+        // 道筋に積まれた段は，組み立てるまで確保領域の節として数えられない．
+        // 正規化している途中の代入式の右辺の分も含める．
+        std::size_t get_pending() const{
+            std::size_t r = std::min(dirty, path.size());
+            for(auto &i : definitions){
+                r += i.cursor->get_pending();
+            }
+            return r;
+        }
+
+        // 代入式の右辺を正規化している途中か．その間は項全体は変わらない．
+        bool normalizing_definition() const{
+            return !definitions.empty();
+        }
+
+        // 現在の項全体の構造の値．項を組み立てずに，道筋に沿って合成した一次式から求める．
+        std::uint32_t get_hash() const{
+            return path.empty() ? focus->hash : path.back().to_root(focus->hash);
+        }
+
+        // 現在の項全体を組み立てる．
+        term_ref get() const{
+            std::size_t n = std::min(dirty, path.size());
+            term_ref r = n < path.size() ? path[n].origin : focus;
+            while(n-- > 0){
+                r = build(path[n], std::move(r));
+            }
+            return r;
+        }
+
+    private:
+        // 道筋の一段．
+        // application : otherは注目していない側の子．rhsなら引数部に注目している．
+        // abstraction : valueは束縛変数名の記号番号．
+        // originは下で簡約が起きていなければ元の節を指し，組み直さずにそのまま使う．
+        // startは正規形の表へ登録する，簡約する前の注目している部分項．
+        // to_rootは注目している部分項の構造の値から根の値を求める一次式．
+        struct frame{
+            term::kind k;
+            std::size_t value;
+            term_ref other;
+            bool rhs;
+            term_ref origin;
+            term_ref start;
+            hash_map to_root;
+        };
+
+        // 積んだ段のto_rootを求める．
+        void compose(){
+            frame &f = path.back();
+            hash_map m = f.k == term::kind::abstraction ? abstraction_map() : f.rhs ? application_rhs_map(f.other->hash) : application_lhs_map(f.other->hash);
+            f.to_root = path.size() > 1 ? path[path.size() - 2].to_root * m : m;
+        }
+
+        static term_ref build(const frame &f, term_ref t){
+            if(f.k == term::kind::abstraction){
+                return make_abstraction(f.value, std::move(t));
+            }else if(f.rhs){
+                return make_application(f.other, std::move(t));
+            }else{
+                return make_application(std::move(t), f.other);
+            }
+        }
+
+        // 独立に正規化される部分項に入る．
+        // 表に正規形があればそれに置き換え，無ければ簡約する前の項を覚えておく．
+        void enter(frame &f){
+            if(!memo || expand_all){
+                return;
+            }
+            const term *nf = memo_table.find(focus.get());
+            if(nf){
+                if(nf != focus.get()){
+                    focus = term_ref(nf);
+                    invalidate();
+                }
+                normal = true;
+                deferred = deferred || nf->globals;
+                f.start = term_ref();
+            }else{
+                f.start = focus;
+            }
+        }
+
+        // 正規形になった部分項から出る．簡約が起きていれば表へ登録する．
+        // 表の代表の節に置き換えておけば，外側の部分項を登録するときに辿り直さずに済む．
+        void leave(frame &f){
+            if(f.start){
+                if(!expand_all && f.start.get() != focus.get()){
+                    const term *nf = memo_table.insert(f.start.get(), focus.get());
+                    if(nf != focus.get()){
+                        focus = term_ref(nf);
+                    }
+                }
+                f.start = term_ref();
+            }
+        }
+
+        // 注目している部分項を一段上へ移す．
+        void up(){
+            leave(path.back());
+            if(path.size() > dirty){
+                focus = std::move(path.back().origin);
+            }else{
+                focus = build(path.back(), std::move(focus));
+            }
+            path.pop_back();
+            dirty = std::min(dirty, path.size());
+        }
+
+        // 注目している部分項より上の節は組み直す必要がある．
+        // 元の節を手放すのは積まれた段ごとに一度だけなので，償却すれば定数の手間で済む．
+        void invalidate(){
+            for(std::size_t i = dirty; i < path.size(); ++i){
+                path[i].origin = term_ref();
+            }
+            dirty = path.size();
+        }
+
+        // 代入式symbolの展開先．cache_definitionsなら正規化した右辺を使う．
+        // まだ正規化していなければ右辺の正規化を積んでnullptrを返すので，呼び出し側はこの展開を後でやり直す．
+        // 正規化は一番外側の走査子が一段ずつ進め，途中の右辺の節も式の確保領域に置く．
+        const term *unfold(std::size_t symbol){
+            const term *def = find_definition(symbol);
+            if(!cache_definitions){
+                return def;
+            }
+            const term *r = normal_definitions[symbol]->load(std::memory_order_acquire);
+            if(r){
+                return r;
+            }
+            reduction_cursor &top = owner ? *owner : *this;
+            // 自身の正規化の途中で再び展開するときは右辺をそのまま使う．
+            for(auto &i : top.definitions){
+                if(i.symbol == symbol){
+                    return def;
+                }
+            }
+            std::unique_ptr<reduction_cursor> cursor(new reduction_cursor(term_ref(def)));
+            cursor->owner = &top;
+            top.definitions.push_back(definition{symbol, std::move(cursor)});
+            return nullptr;
+        }
+
+        // 最後に積んだ代入式の右辺を一段簡約し，段数をこの走査子に数える．
+        // 正規形に達するか上限を使い切った右辺は表へ書いて降ろす．
+        // 積んだ右辺が残っていればtrueを返し，無くなれば呼び出し側は待っていた展開をやり直す．
+        bool step_definition(){
+            std::size_t i = definitions.size() - 1;
+            reduction_cursor &c = *definitions[i].cursor;
+            std::size_t before = c.get_steps();
+            step_status s = c.step();
+            steps += c.get_steps() - before;
+            // 別の右辺の正規化を積んだときは，その右辺を先に進める．
+            if(definitions.size() - 1 == i && (s == step_status::normal_form || c.get_steps() >= definition_budget)){
+                std::size_t symbol = definitions[i].symbol;
+                term_ref nf = s == step_status::normal_form ? c.get() : term_ref(find_definition(symbol));
+                definitions.pop_back();
+                publish_definition(symbol, nf.get());
+            }
+            return !definitions.empty();
+        }
+
+        void contracted(){
+            invalidate();
+            normal = false;
+            ++steps;
+
+            // 関数部が抽象か代入式の左辺になったら，一つ上の関数適用が次の簡約基になる．
+            if(!path.empty() && path.back().k == term::kind::application && !path.back().rhs && (focus->get_kind() == term::kind::abstraction || (focus->get_kind() == term::kind::free && find_definition(focus->value)))){
+                up();
+            }
+        }
+
+        term_ref focus;
+        std::vector<frame> path;
+
+        // focusが正規形であることが分かっているか．
+        bool normal;
+
+        // 関数部以外に代入式の左辺が残っているか．
+        bool deferred;
+
+        // 全ての位置の代入式の左辺を展開するか．
+        bool expand_all;
+
+        // 正規形の表を使うか．rootは項全体の正規化を表す段．
+        bool memo;
+        frame root;
+
+        // 頭部正規形で止めるか．
+        bool head;
+
+        // 正規化している代入式の右辺．後に積んだものほど先に正規化し終える．
+        // ownerは右辺を正規化する走査子を進める一番外側の走査子で，自身がそうならnullptr．
+        struct definition{
+            std::size_t symbol;
+            std::unique_ptr<reduction_cursor> cursor;
+        };
+
+        std::vector<definition> definitions;
+        reduction_cursor *owner;
+
+        // path[dirty]以降の段はoriginを保っている．
+        std::size_t dirty;
+
+        std::size_t steps;
+    };
+
+    // 簡約の途中の項が，以前の項とα同値な項に戻ったことを見つける．
+    // Brentの方法で，覚えた項から2のべき乗段進むごとに覚え直し，その間の項を覚えた項と比べる．
+    // 項は構造の値で比べ，一致したときだけ節を辿って確かめる．
+    class cycle_detector{
+    public:
+        explicit cycle_detector(const reduction_cursor &cursor) : saved(cursor.get()), saved_hash(cursor.get_hash()), power(1), length(1){}
+
+        // 一段簡約した後に呼ぶ．閉路を見つけたらその長さを，そうでなければ0を返す．
+        // 代入式の右辺を正規化している間は項全体が変わらないので調べない．
+        std::size_t check(const reduction_cursor &cursor){
+            if(cursor.normalizing_definition()){
+                return 0;
+            }
+            std::uint32_t h = cursor.get_hash();
+            if(h == saved_hash && same_term(cursor.get().get(), saved.get())){
+                return length;
+            }
+            if(length == power){
+                saved = cursor.get();
+                saved_hash = h;
+                power *= 2;
+                length = 0;
+            }
+            ++length;
+            return 0;
+        }
+
+    private:
+        term_ref saved;
+        std::uint32_t saved_hash;
+        std::size_t power, length;
+    };
+
+    // 正規化した代入式の右辺nfを表へ書く．
+    // 他のスレッドが先に書いていればそれを使う．固定されていない節はdefinition_arenaへ写して固定する．
+    void publish_definition(std::size_t symbol, const term *nf){
+        std::lock_guard<std::mutex> lock(normal_definitions_mutex);
+        if(normal_definitions[symbol]->load(std::memory_order_relaxed)){
+            return;
+        }
+        arena_switch s(definition_arena);
+        std::map<const term*, term_ref> memo;
+        term_ref n = import(nf, memo);
+        pin(n.get());
+        normal_definitions[symbol]->store(n.get(), std::memory_order_release);
+    }
+}
+
+// 二つの式がα同値か調べる．
+// 名前なしの項へ変換して比べるので，束縛変数名の違いと関数適用の括弧の付け方の違いは無視する．
+bool internal_data::equal_expr(const expr *a, const expr *b){
+    return nameless_data::same_term(nameless_data::lower(a).get(), nameless_data::lower(b).get());
+}
+
+// 必要呼びによるグラフ簡約．
+// 引数は共有されるサンクとして渡し，一度評価したらその場で結果に書き換える．
+namespace graph_reduction{
+    using nameless_data::term;
+    using nameless_data::term_ref;
+
+    struct cell;
+    struct environment;
+
+    using cell_ptr = std::shared_ptr<cell>;
+    using environment_ptr = std::shared_ptr<environment>;
+
+    // 環境．先頭が指標0に対応する．
+    struct environment : nameless_data::counted_node{
+        ~environment();
+
+        cell_ptr value;
+        environment_ptr next;
+    };
+
+    // グラフの節．
+    struct cell : nameless_data::counted_node{
+        enum class kind{
+            thunk,
+            blackhole,
+            closure,
+            neutral
+        };
+
+        kind k;
+
+        // thunk : 未評価の項．
+        // closure : 抽象．
+        const term *code;
+        environment_ptr env;
+
+        // neutral : 頭部の変数と引数．
+        // 頭部はfree_headなら記号番号，そうでなければ束縛された深さ．
+        bool free_head;
+        std::size_t head;
+        std::vector<cell_ptr> args;
+
+        ~cell();
+    };
+
+    // 長い鎖を再帰せずに壊す．
+    // 最後の参照を失う子はその場で壊さずに積み，壊している最中でなければ積んだものを一つずつ壊す．
+    struct graveyard{
+        std::vector<cell_ptr> cells;
+        std::vector<environment_ptr> environments;
+        bool draining;
+    };
+
+    thread_local graveyard dead = {{}, {}, false};
+
+    void drain(){
+        if(dead.draining){
+            return;
+        }
+        dead.draining = true;
+        while(!dead.cells.empty() || !dead.environments.empty()){
+            if(!dead.cells.empty()){
+                cell_ptr c = std::move(dead.cells.back());
+                dead.cells.pop_back();
+            }else{
+                environment_ptr e = std::move(dead.environments.back());
+                dead.environments.pop_back();
+            }
+        }
+        dead.draining = false;
+    }
+
+    template<class T>
+    void bury(std::shared_ptr<T> &p, std::vector<std::shared_ptr<T>> &v){
+        if(p.use_count() == 1){
+            v.push_back(std::move(p));
+        }
+    }
+
+    environment::~environment(){
+        bury(value, dead.cells);
+        bury(next, dead.environments);
+        drain();
+    }
+
+    cell::~cell(){
+        bury(env, dead.environments);
+        for(auto &i : args){
+            bury(i, dead.cells);
+        }
+        drain();
+    }
+
+    // 無限ループの検出．
+    class infinite_loop : public app_exception{
+    public:
+        infinite_loop() : app_exception("detected infinite loop."){}
+        infinite_loop(const infinite_loop&) = default;
+        ~infinite_loop() = default;
+    };
+
+    cell_ptr make_thunk(const term *code, environment_ptr env){
+        cell_ptr r = std::make_shared<cell>();
+        r->k = cell::kind::thunk;
+        r->code = code;
+        r->env = std::move(env);
+        return r;
+    }
+
+    cell_ptr make_closure(const term *code, environment_ptr env){
+        cell_ptr r = std::make_shared<cell>();
+        r->k = cell::kind::closure;
+        r->code = code;
+        r->env = std::move(env);
+        return r;
+    }
+
+    cell_ptr make_neutral(bool free_head, std::size_t head){
+        cell_ptr r = std::make_shared<cell>();
+        r->k = cell::kind::neutral;
+        r->code = nullptr;
+        r->free_head = free_head;
+        r->head = head;
+        return r;
+    }
+
+    environment_ptr extend(cell_ptr value, environment_ptr next){
+        environment_ptr r = std::make_shared<environment>();
+        r->value = std::move(value);
+        r->next = std::move(next);
+        return r;
+    }
+
+    const cell_ptr &lookup(const environment *env, std::size_t index){
+        for(; index > 0; --index){
+            env = env->next.get();
+        }
+        return env->value;
+    }
+
+    // サンクを評価結果で上書きする．
+    void update(cell &c, const cell &value){
+        c.k = value.k;
+        c.code = value.code;
+        c.env = value.env;
+        c.free_head = value.free_head;
+        c.head = value.head;
+        c.args = value.args;
+    }
+
+    class machine{
+    public:
+        machine() : steps(0){}
+
+        // 項を正規形まで評価する．
+        term_ref normalize(const term_ref &t){
+            return reify(make_thunk(t.get(), nullptr), 0);
+        }
+
+        // これまでに行ったβ簡約の数．
+        std::size_t get_steps() const{
+            return steps;
+        }
+
+        // 節を弱頭部正規形まで評価する．
+        // 引数と更新待ちのサンクは一つのスタックに積み，再帰しない．
+        cell_ptr whnf(const cell_ptr &c){
+            if(c->k == cell::kind::closure || c->k == cell::kind::neutral){
+                return c;
+            }
+
+            struct frame{
+                bool update;
+                cell_ptr c;
+            };
+
+            std::vector<frame> stack;
+            const term *t;
+            environment_ptr e;
+            cell_ptr v;
+
+            auto enter = [&](const cell_ptr &x){
+                if(x->k == cell::kind::blackhole){
+                    throw infinite_loop();
+                }
+                frame f;
+                f.update = true;
+                f.c = x;
+                stack.push_back(f);
+                t = x->code;
+                e = x->env;
+                x->k = cell::kind::blackhole;
+                x->env.reset();
+            };
+
+            enter(c);
+            while(true){
+                if(!v){
+                    switch(t->get_kind()){
+                    case term::kind::application:
+                        {
+                            frame f;
+                            f.update = false;
+                            f.c = make_thunk(t->rhs, e);
+                            stack.push_back(f);
+                            t = t->lhs;
+                        }
+                        continue;
+
+                    case term::kind::abstraction:
+                        if(!stack.empty() && !stack.back().update){
+                            e = extend(std::move(stack.back().c), std::move(e));
+                            stack.pop_back();
+                            t = t->lhs;
+                            ++steps;
+                            continue;
+                        }
+                        v = make_closure(t, std::move(e));
+                        break;
+
+                    case term::kind::bound:
+                        {
+                            const cell_ptr &x = lookup(e.get(), t->value);
+                            if(x->k == cell::kind::closure || x->k == cell::kind::neutral){
+                                v = x;
+                            }else{
+                                cell_ptr y = x;
+                                enter(y);
+                                continue;
+                            }
+                        }
+                        break;
+
+                    case term::kind::free:
+                        if(nameless_data::find_definition(t->value)){
+                            cell_ptr x = global(t->value);
+                            if(x->k == cell::kind::closure || x->k == cell::kind::neutral){
+                                v = x;
+                            }else{
+                                enter(x);
+                                continue;
+                            }
+                        }else{
+                            v = make_neutral(true, t->value);
+                        }
+                        break;
+                    }
+                }
+
+                if(stack.empty()){
+                    return v;
+                }
+                frame &f = stack.back();
+                if(f.update){
+                    update(*f.c, *v);
+                    stack.pop_back();
+                }else if(v->k == cell::kind::closure){
+                    t = v->code;
+                    e = v->env;
+                    v.reset();
+                }else{
+                    if(v.use_count() != 1){
+                        cell_ptr n = make_neutral(v->free_head, v->head);
+                        n->args = v->args;
+                        v = n;
+                    }
+                    v->args.push_back(std::move(f.c));
+                    stack.pop_back();
+                }
+            }
+        }
+
+        // 節を正規形まで評価して名前なしの項へ戻す．
+        // levelは外側にある抽象の数．
+        // 弱頭部正規形にした節は二度目に取り出したときに，子の結果から組み立てる．
+        term_ref reify(const cell_ptr &c, std::size_t level){
+            struct frame{
+                cell_ptr c;
+                std::size_t level;
+                bool done;
+            };
+
+            std::vector<frame> frames;
+            std::vector<term_ref> results;
+            frames.push_back(frame{c, level, false});
+            while(!frames.empty()){
+                frame f = std::move(frames.back());
+                frames.pop_back();
+                if(f.done){
+                    if(f.c->k == cell::kind::closure){
+                        results.back() = nameless_data::make_abstraction(f.c->code->value, std::move(results.back()));
+                    }else{
+                        auto first = results.end() - f.c->args.size();
+                        term_ref r = f.c->free_head ? nameless_data::make_free(f.c->head) : nameless_data::make_bound(f.level - f.c->head - 1);
+                        for(auto iter = first; iter != results.end(); ++iter){
+                            r = nameless_data::make_application(std::move(r), std::move(*iter));
+                        }
+                        results.erase(first, results.end());
+                        results.push_back(std::move(r));
+                    }
+                    continue;
+                }
+                cell_ptr v = whnf(f.c);
+                frames.push_back(frame{v, f.level, true});
+                if(v->k == cell::kind::closure){
+                    cell_ptr var = make_neutral(false, f.level);
+                    frames.push_back(frame{make_thunk(v->code->lhs, extend(var, v->env)), f.level + 1, false});
+                }else{
+                    for(auto iter = v->args.rbegin(); iter != v->args.rend(); ++iter){
+                        frames.push_back(frame{*iter, f.level, false});
+                    }
+                }
+            }
+            return std::move(results.back());
+        }
+
+    private:
+        // 代入式の右辺は一回の評価の中で共有する．
+        cell_ptr global(std::size_t symbol){
+            if(globals.size() <= symbol){
+                globals.resize(symbol + 1);
+            }
+            if(!globals[symbol]){
+                globals[symbol] = make_thunk(nameless_data::find_definition(symbol), nullptr);
+            }
+            return globals[symbol];
+        }
+
+        std::vector<cell_ptr> globals;
+        std::size_t steps;
+    };
+}
+
+// Krivine機械による名前呼びの評価．
+// 項を書き換えずに閉包と環境で弱頭部正規形まで評価し，表示するときだけ項へ戻す．
+namespace krivine_machine{
+    using nameless_data::term;
+    using nameless_data::term_ref;
+
+    struct closure;
+    struct environment;
+
+    using closure_ptr = std::shared_ptr<closure>;
+    using environment_ptr = std::shared_ptr<environment>;
+
+    // 環境．先頭が指標0に対応する．
+    struct environment : nameless_data::counted_node{
+        closure_ptr value;
+        environment_ptr next;
+    };
+
+    // 閉包．
+    struct closure : nameless_data::counted_node{
+        const term *code;
+        environment_ptr env;
+    };
+
+    closure_ptr make_closure(const term *code, environment_ptr env){
+        closure_ptr r = std::make_shared<closure>();
+        r->code = code;
+        r->env = std::move(env);
+        return r;
+    }
+
+    environment_ptr extend(closure_ptr value, environment_ptr next){
+        environment_ptr r = std::make_shared<environment>();
+        r->value = std::move(value);
+        r->next = std::move(next);
+        return r;
+    }
+
+    const closure_ptr &lookup(const environment *env, std::size_t index){
+        for(; index > 0; --index){
+            env = env->next.get();
+        }
+        return env->value;
+    }
+
+    class machine{
+    public:
+        machine() : steps(0){}
+
+        // これまでに行ったβ簡約の数．
+        std::size_t get_steps() const{
+            return steps;
+        }
+
+        // 項を弱頭部正規形まで評価して名前なしの項へ戻す．
+        term_ref whnf(const term_ref &root){
+            const term *t = root.get();
+            environment_ptr e;
+            std::vector<closure_ptr> stack;
+            while(true){
+                switch(t->get_kind()){
+                case term::kind::application:
+                    stack.push_back(make_closure(t->rhs, e));
+                    t = t->lhs;
+                    continue;
+
+                case term::kind::abstraction:
+                    if(stack.empty()){
+                        return readback(t, e.get(), 0);
+                    }
+                    e = extend(std::move(stack.back()), std::move(e));
+                    stack.pop_back();
+                    t = t->lhs;
+                    ++steps;
+                    continue;
+
+                case term::kind::bound:
+                    {
+                        closure_ptr c = lookup(e.get(), t->value);
+                        t = c->code;
+                        e = c->env;
+                    }
+                    continue;
+
+                case term::kind::free:
+                    {
+                        const term *def = nameless_data::find_definition(t->value);
+                        if(def){
+                            t = def;
+                            e.reset();
+                            continue;
+                        }
+                    }
+                    break;
+                }
+                break;
+            }
+
+            // 頭部が自由変数の場合．
+            term_ref r(t);
+            for(auto iter = stack.rbegin(); iter != stack.rend(); ++iter){
+                r = nameless_data::make_application(std::move(r), readback(**iter));
+            }
+            return r;
+        }
+
+    private:
+        // 読み戻しの段．cがあれば閉包を戻してdepthだけずらし，無ければ環境envの下の項tを戻す．
+        struct frame{
+            const term *t;
+            const environment *env;
+            const closure *c;
+            std::size_t depth;
+            bool done;
+        };
+
+        // 閉包を項へ戻す．
+        // 環境の中身を代入するだけで簡約はしない．
+        term_ref readback(const closure &c){
+            return readback(frame{nullptr, nullptr, &c, 0, false});
+        }
+
+        term_ref readback(const term *t, const environment *env, std::size_t depth){
+            return readback(frame{t, env, nullptr, depth, false});
+        }
+
+        // 子を戻し終えた項は二度目に取り出したときに組み立てる．
+        // 閉包は戻し終えたら二度目に取り出したときに覚えておく．
+        term_ref readback(frame start){
+            std::vector<frame> frames;
+            std::vector<term_ref> results;
+            frames.push_back(start);
+            while(!frames.empty()){
+                frame f = frames.back();
+                frames.pop_back();
+                if(f.c){
+                    if(f.done){
+                        memo.insert(std::make_pair(f.c, results.back()));
+                    }else{
+                        auto iter = memo.find(f.c);
+                        if(iter == memo.end()){
+                            frames.push_back(frame{nullptr, nullptr, f.c, f.depth, true});
+                            frames.push_back(frame{f.c->code, f.c->env.get(), nullptr, 0, false});
+                            continue;
+                        }
+                        results.push_back(iter->second);
+                    }
+                    if(f.depth > 0){
+                        results.back() = nameless_data::shift(results.back().get(), f.depth, 0);
+                    }
+                    continue;
+                }
+                if(!f.env){
+                    results.push_back(term_ref(f.t));
+                    continue;
+                }
+                switch(f.t->get_kind()){
+                case term::kind::bound:
+                    if(f.t->value < f.depth){
+                        results.push_back(term_ref(f.t));
+                    }else{
+                        frames.push_back(frame{nullptr, nullptr, lookup(f.env, f.t->value - f.depth).get(), f.depth, false});
+                    }
+                    break;
+
+                case term::kind::free:
+                    results.push_back(term_ref(f.t));
+                    break;
+
+                case term::kind::application:
+                    if(f.done){
+                        term_ref rhs(std::move(results.back()));
+                        results.pop_back();
+                        results.back() = nameless_data::rebuild_application(f.t, std::move(results.back()), std::move(rhs));
+                    }else{
+                        frames.push_back(frame{f.t, f.env, nullptr, f.depth, true});
+                        frames.push_back(frame{f.t->rhs, f.env, nullptr, f.depth, false});
+                        frames.push_back(frame{f.t->lhs, f.env, nullptr, f.depth, false});
+                    }
+                    break;
+
+                case term::kind::abstraction:
+                    if(f.done){
+                        results.back() = nameless_data::rebuild_abstraction(f.t, std::move(results.back()));
+                    }else{
+                        frames.push_back(frame{f.t, f.env, nullptr, f.depth, true});
+                        frames.push_back(frame{f.t->lhs, f.env, nullptr, f.depth + 1, false});
+                    }
+                    break;
+                }
+            }
+            return std::move(results.back());
+        }
+
+        std::map<const closure*, term_ref> memo;
+        std::size_t steps;
+    };
+}
+
+// 評価による正規化．
+// 項を関数の値と中立項からなる意味領域の値へ評価し，値を正規形の項へ戻す．
+// 関数の値は抽象とその環境の組で表し，評価も読み戻しも明示的なスタックで進めて再帰しない．
+namespace normalization_by_evaluation{
+    using nameless_data::term;
+    using nameless_data::term_ref;
+
+    struct value;
+    struct delayed;
+    struct environment;
+
+    using value_ptr = std::shared_ptr<const value>;
+    using delayed_ptr = std::shared_ptr<delayed>;
+    using environment_ptr = std::shared_ptr<const environment>;
+
+    struct argument;
+    using argument_ptr = std::shared_ptr<const argument>;
+
+    // 環境．先頭が指標0に対応する．
+    struct environment : nameless_data::counted_node{
+        ~environment();
+
+        delayed_ptr value;
+        environment_ptr next;
+    };
+
+    // 中立項の引数の列．最後に渡した引数が先頭に来る．
+    // 引数を足しても元の列は変えないので，同じ頭部と引数を持つ値どうしで共有できる．
+    struct argument : nameless_data::counted_node{
+        ~argument();
+
+        delayed_ptr value;
+        argument_ptr next;
+    };
+
+    // 意味領域の値．
+    struct value : nameless_data::counted_node{
+        enum class kind{
+            function,
+            neutral
+        };
+
+        kind k;
+
+        // function : 抽象とその環境．表示用の束縛変数名は抽象の記号番号を使う．
+        const term *code;
+        environment_ptr env;
+
+        // neutral : 頭部の変数と引数．arityは引数の数．
+        // 頭部はfree_headなら記号番号，そうでなければ束縛された深さ．
+        bool free_head;
+        std::size_t head;
+        argument_ptr args;
+        std::size_t arity;
+
+        ~value();
+    };
+
+    // 遅延された値．
+    // 引数は必要になったときに一度だけ評価する．forcingは評価している最中を表す．
+    struct delayed : nameless_data::counted_node{
+        const term *code;
+        environment_ptr env;
+        value_ptr forced;
+        bool forcing;
+
+        ~delayed();
+    };
+
+    // 無限ループの検出．
+    class infinite_loop : public app_exception{
+    public:
+        infinite_loop() : app_exception("detected infinite loop."){}
+        infinite_loop(const infinite_loop&) = default;
+        ~infinite_loop() = default;
+    };
+
+    // 長い鎖を再帰せずに壊す．
+    // 最後の参照を失う子はその場で壊さずに積み，壊している最中でなければ積んだものを一つずつ壊す．
+    struct graveyard{
+        std::vector<value_ptr> values;
+        std::vector<delayed_ptr> delayeds;
+        std::vector<environment_ptr> environments;
+        std::vector<argument_ptr> arguments;
+        bool draining;
+    };
+
+    thread_local graveyard dead = {{}, {}, {}, {}, false};
+
+    void drain(){
+        if(dead.draining){
+            return;
+        }
+        dead.draining = true;
+        while(!dead.values.empty() || !dead.delayeds.empty() || !dead.environments.empty() || !dead.arguments.empty()){
+            if(!dead.values.empty()){
+                value_ptr v = std::move(dead.values.back());
+                dead.values.pop_back();
+            }else if(!dead.delayeds.empty()){
+                delayed_ptr d = std::move(dead.delayeds.back());
+                dead.delayeds.pop_back();
+            }else if(!dead.arguments.empty()){
+                argument_ptr a = std::move(dead.arguments.back());
+                dead.arguments.pop_back();
+            }else{
+                environment_ptr e = std::move(dead.environments.back());
+                dead.environments.pop_back();
+            }
+        }
+        dead.draining = false;
+    }
+
+    template<class T>
+    void bury(std::shared_ptr<T> &p, std::vector<std::shared_ptr<T>> &v){
+        if(p.use_count() == 1){
+            v.push_back(std::move(p));
+        }
+    }
+
+    environment::~environment(){
+        bury(value, dead.delayeds);
+        bury(next, dead.environments);
+        drain();
+    }
+
+    argument::~argument(){
+        bury(value, dead.delayeds);
+        bury(next, dead.arguments);
+        drain();
+    }
+
+    value::~value(){
+        bury(env, dead.environments);
+        bury(args, dead.arguments);
+        drain();
+    }
+
+    delayed::~delayed(){
+        bury(env, dead.environments);
+        bury(forced, dead.values);
+        drain();
+    }
+
+    value_ptr make_neutral(bool free_head, std::size_t head){
+        std::shared_ptr<value> r = std::make_shared<value>();
+        r->k = value::kind::neutral;
+        r->code = nullptr;
+        r->free_head = free_head;
+        r->head = head;
+        r->arity = 0;
+        return r;
+    }
+
+    value_ptr make_function(const term *code, environment_ptr env){
+        std::shared_ptr<value> r = std::make_shared<value>();
+        r->k = value::kind::function;
+        r->code = code;
+        r->env = std::move(env);
+        return r;
+    }
+
+    delayed_ptr make_delayed(const term *code, environment_ptr env){
+        delayed_ptr r = std::make_shared<delayed>();
+        r->code = code;
+        r->env = std::move(env);
+        r->forcing = false;
+        return r;
+    }
+
+    delayed_ptr make_delayed(value_ptr v){
+        delayed_ptr r = std::make_shared<delayed>();
+        r->code = nullptr;
+        r->forced = std::move(v);
+        r->forcing = false;
+        return r;
+    }
+
+    environment_ptr extend(delayed_ptr value, environment_ptr next){
+        std::shared_ptr<environment> r = std::make_shared<environment>();
+        r->value = std::move(value);
+        r->next = std::move(next);
+        return r;
+    }
+
+    class evaluator{
+    public:
+        evaluator() : steps(0){}
+
+        // 項を正規形まで評価する．
+        term_ref normalize(const term_ref &t){
+            return reify(force(make_delayed(t.get(), nullptr)), 0);
+        }
+
+        // これまでに関数の値へ引数を渡した数．
+        std::size_t get_steps() const{
+            return steps;
+        }
+
+        // 代入式の右辺の値を忘れる．
+        // 値は評価した時点で未定義だった名前を中立項として含むので，代入式が増えたら呼ぶ．
+        void clear_globals(){
+            globals.clear();
+        }
+
+    private:
+        // 遅延された値を評価する．
+        // 渡す引数と書き戻す遅延された値は一つのスタックに積み，再帰しない．
+        value_ptr force(const delayed_ptr &d){
+            if(d->forced){
+                return d->forced;
+            }
+
+            struct frame{
+                bool update;
+                delayed_ptr d;
+            };
+
+            std::vector<frame> stack;
+            const term *t;
+            environment_ptr e;
+            value_ptr v;
+
+            auto enter = [&](const delayed_ptr &x){
+                if(x->forcing){
+                    throw infinite_loop();
+                }
+                x->forcing = true;
+                stack.push_back(frame{true, x});
+                t = x->code;
+                e = x->env;
+            };
+
+            enter(d);
+            while(true){
+                if(!v){
+                    switch(t->get_kind()){
+                    case term::kind::bound:
+                        {
+                            const environment *x = e.get();
+                            for(std::size_t i = t->value; i > 0; --i){
+                                x = x->next.get();
+                            }
+                            if(x->value->forced){
+                                v = x->value->forced;
+                            }else{
+                                delayed_ptr y = x->value;
+                                enter(y);
+                                continue;
+                            }
+                        }
+                        break;
+
+                    case term::kind::free:
+                        if(nameless_data::find_definition(t->value)){
+                            delayed_ptr x = global(t->value);
+                            if(x->forced){
+                                v = x->forced;
+                            }else{
+                                enter(x);
+                                continue;
+                            }
+                        }else{
+                            v = make_neutral(true, t->value);
+                        }
+                        break;
+
+                    case term::kind::application:
+                        stack.push_back(frame{false, make_delayed(t->rhs, e)});
+                        t = t->lhs;
+                        continue;
+
+                    case term::kind::abstraction:
+                        v = make_function(t, std::move(e));
+                        break;
+                    }
+                }
+
+                if(stack.empty()){
+                    return v;
+                }
+                frame &f = stack.back();
+                if(f.update){
+                    f.d->forced = v;
+                    f.d->forcing = false;
+                    f.d->env.reset();
+                    stack.pop_back();
+                }else if(v->k == value::kind::function){
+                    ++steps;
+                    t = v->code->lhs;
+                    e = extend(std::move(f.d), v->env);
+                    v.reset();
+                    stack.pop_back();
+                }else{
+                    // 他から参照されていない中立項にはその場で引数を足し，そうでなければ引数の列を共有した値を作る．
+                    std::shared_ptr<value> r = v.use_count() == 1 ? std::const_pointer_cast<value>(v) : std::make_shared<value>(*v);
+                    std::shared_ptr<argument> a = std::make_shared<argument>();
+                    a->value = std::move(f.d);
+                    a->next = std::move(r->args);
+                    r->args = std::move(a);
+                    ++r->arity;
+                    v = std::move(r);
+                    stack.pop_back();
+                }
+            }
+        }
+
+        // 値を正規形の項へ戻す．
+        // levelは外側にある抽象の数．
+        // 値は二度目に取り出したときに，子の結果から組み立てる．引数は取り出したときに評価する．
+        term_ref reify(const value_ptr &v, std::size_t level){
+            struct frame{
+                value_ptr v;
+                delayed_ptr d;
+                std::size_t level;
+                bool done;
+            };
+
+            std::vector<frame> frames;
+            std::vector<term_ref> results;
+            frames.push_back(frame{v, nullptr, level, false});
+            while(!frames.empty()){
+                frame f = std::move(frames.back());
+                frames.pop_back();
+                if(!f.v){
+                    f.v = force(f.d);
+                }
+                if(f.done){
+                    if(f.v->k == value::kind::function){
+                        results.back() = nameless_data::make_abstraction(f.v->code->value, std::move(results.back()));
+                    }else{
+                        auto first = results.end() - f.v->arity;
+                        term_ref r = f.v->free_head ? nameless_data::make_free(f.v->head) : nameless_data::make_bound(f.level - f.v->head - 1);
+                        for(auto iter = first; iter != results.end(); ++iter){
+                            r = nameless_data::make_application(std::move(r), std::move(*iter));
+                        }
+                        results.erase(first, results.end());
+                        results.push_back(std::move(r));
+                    }
+                    continue;
+                }
+                frames.push_back(frame{f.v, nullptr, f.level, true});
+                if(f.v->k == value::kind::function){
+                    delayed_ptr var = make_delayed(make_neutral(false, f.level));
+                    frames.push_back(frame{force(make_delayed(f.v->code->lhs, extend(std::move(var), f.v->env))), nullptr, f.level + 1, false});
+                }else{
+                    for(const argument *a = f.v->args.get(); a; a = a->next.get()){
+                        frames.push_back(frame{nullptr, a->value, f.level, false});
+                    }
+                }
+            }
+            return std::move(results.back());
+        }
+
+        // 代入式の右辺の値は全ての行で共有する．
+        // 右辺を評価する間に表が伸びて移ることがあるので，参照ではなく複製を返す．
+        delayed_ptr global(std::size_t symbol){
+            if(globals.size() <= symbol){
+                globals.resize(symbol + 1);
+            }
+            if(!globals[symbol]){
+                globals[symbol] = make_delayed(nameless_data::find_definition(symbol), nullptr);
+            }
+            return globals[symbol];
+        }
+
+        std::vector<delayed_ptr> globals;
+        std::size_t steps;
+    };
+}
+
+// 相互作用ネットによる最適簡約．
+// Lampingの抽象アルゴリズムに括弧とクロワッサンを加えたもので，共有された簡約基は一度だけ簡約する．
+namespace interaction_net{
+    using nameless_data::term;
+    using nameless_data::term_ref;
+
+    struct node;
+
+    // 節のポート．slotが0なら主ポート．
+    struct port{
+        node *n;
+        std::size_t slot;
+    };
+
+    // ネットの節．
+    struct node{
+        enum class kind{
+            root,
+            free,
+            lambda,
+            application,
+            fan,
+            bracket,
+            croissant,
+            eraser
+        };
+
+        kind k;
+
+        // 節の深さ．
+        std::size_t index;
+
+        // lambda : 表示用の束縛変数名の記号番号．
+        // free : 記号番号．
+        std::size_t value;
+
+        // lambda : 0が抽象，1が本体，2が束縛．
+        // application : 0が関数，1が結果，2が引数．
+        // fan : 0が主，1と2が補助．
+        // bracket, croissant : 0が主，1が補助．
+        port link[3];
+
+        // 節を消すたびに増やす．再利用された節と区別する．
+        std::size_t generation;
+    };
+
+    std::size_t arity(node::kind k){
+        switch(k){
+        case node::kind::lambda:
+        case node::kind::application:
+        case node::kind::fan:
+            return 3;
+
+        case node::kind::bracket:
+        case node::kind::croissant:
+            return 2;
+
+        default:
+            return 1;
+        }
+    }
+
+    bool is_control(node::kind k){
+        return k == node::kind::fan || k == node::kind::bracket || k == node::kind::croissant;
+    }
+
+    // 再帰的な代入式．
+    class recursive_definition : public app_exception{
+    public:
+        recursive_definition(std::string name) : app_exception("recursive definition is not supported by optimal reduction: " + name){}
+        recursive_definition(const recursive_definition&) = default;
+        ~recursive_definition() = default;
+    };
+
+    // ネットが想定しない形になった．
+    class broken_net : public app_exception{
+    public:
+        broken_net() : app_exception("optimal reduction: broken net."){}
+        broken_net(const broken_net&) = default;
+        ~broken_net() = default;
+    };
+
+    // 自由変数symbolを深さdepthの束縛変数に置き換える．
+    // 子を置き換え終えた節は二度目に取り出したときに組み直す．
+    term_ref abstract(const term *t, std::size_t symbol, std::size_t depth){
+        struct frame{
+            const term *t;
+            std::size_t depth;
+            bool done;
+        };
+
+        std::vector<frame> frames;
+        std::vector<term_ref> results;
+        frames.push_back(frame{t, depth, false});
+        while(!frames.empty()){
+            frame f = frames.back();
+            frames.pop_back();
+            switch(f.t->get_kind()){
+            case term::kind::bound:
+                results.push_back(f.t->value >= f.depth ? nameless_data::make_bound(f.t->value + 1) : term_ref(f.t));
+                break;
+
+            case term::kind::free:
+                results.push_back(f.t->value == symbol ? nameless_data::make_bound(f.depth) : term_ref(f.t));
+                break;
+
+            case term::kind::application:
+                if(f.done){
+                    term_ref rhs(std::move(results.back()));
+                    results.pop_back();
+                    results.back() = nameless_data::rebuild_application(f.t, std::move(results.back()), std::move(rhs));
+                }else{
+                    frames.push_back(frame{f.t, f.depth, true});
+                    frames.push_back(frame{f.t->rhs, f.depth, false});
+                    frames.push_back(frame{f.t->lhs, f.depth, false});
+                }
+                break;
+
+            case term::kind::abstraction:
+                if(f.done){
+                    results.back() = nameless_data::rebuild_abstraction(f.t, std::move(results.back()));
+                }else{
+                    frames.push_back(frame{f.t, f.depth, true});
+                    frames.push_back(frame{f.t->lhs, f.depth + 1, false});
+                }
+                break;
+            }
+        }
+        return std::move(results.back());
+    }
+
+    // 項から参照される代入式を依存される順に並べる．
+    // 右辺を辿り終えた代入式は二度目に取り出したときに並べる．
+    void collect_globals(const term *t, std::vector<int> &state, std::vector<std::size_t> &order){
+        struct frame{
+            const term *t;
+            std::size_t symbol;
+            bool done;
+        };
+
+        std::vector<frame> frames;
+        frames.push_back(frame{t, 0, false});
+        while(!frames.empty()){
+            frame f = frames.back();
+            frames.pop_back();
+            if(f.done){
+                state[f.symbol] = 2;
+                order.push_back(f.symbol);
+                continue;
+            }
+            switch(f.t->get_kind()){
+            case term::kind::bound:
+                break;
+
+            case term::kind::free:
+                {
+                    const term *def = nameless_data::find_definition(f.t->value);
+                    if(!def){
+                        break;
+                    }
+                    if(state.size() <= f.t->value){
+                        state.resize(f.t->value + 1, 0);
+                    }
+                    if(state[f.t->value] == 1){
+                        throw recursive_definition(nameless_data::symbols.name(f.t->value));
+                    }
+                    if(state[f.t->value] == 0){
+                        state[f.t->value] = 1;
+                        frames.push_back(frame{nullptr, f.t->value, true});
+                        frames.push_back(frame{def, 0, false});
+                    }
+                }
+                break;
+
+            case term::kind::application:
+                frames.push_back(frame{f.t->rhs, 0, false});
+                frames.push_back(frame{f.t->lhs, 0, false});
+                break;
+
+            case term::kind::abstraction:
+                frames.push_back(frame{f.t->lhs, 0, false});
+                break;
+            }
+        }
+    }
+
+    // 代入式を共有するため，参照される右辺をλで束縛して閉じた項にする．
+    term_ref close_globals(const term_ref &t){
+        std::vector<int> state;
+        std::vector<std::size_t> order;
+        collect_globals(t.get(), state, order);
+        term_ref r = t;
+        for(auto iter = order.rbegin(); iter != order.rend(); ++iter){
+            r = nameless_data::make_application(
+                nameless_data::make_abstraction(*iter, abstract(r.get(), *iter, 0)),
+                term_ref(nameless_data::find_definition(*iter))
+            );
+        }
+        return r;
+    }
+
+    class net{
+    public:
+        net() : interactions(0), betas(0){}
+        net(const net&) = delete;
+
+        ~net(){
+            nameless_data::line_arena.uncount_external(nodes.size() - free_nodes.size());
+        }
+
+        // 項を正規形まで簡約する．
+        term_ref normalize(const term_ref &t){
+            node *root = make_node(node::kind::root, 0);
+            fragment f = translate(close_globals(t).get(), 0, 0);
+            link(port{root, 0}, f.root);
+            return readback(port{root, 0});
+        }
+
+        std::size_t get_interactions() const{
+            return interactions;
+        }
+
+        std::size_t get_betas() const{
+            return betas;
+        }
+
+    private:
+        // 変換途中の部分ネット．
+        // varsは束縛変数ごとに束縛側へ繋ぐポート．束縛するλの深さで引く．
+        struct fragment{
+            port root;
+            std::map<std::size_t, port> vars;
+        };
+
+        node *make_node(node::kind k, std::size_t index){
+            node *r;
+            nameless_data::line_arena.count_external(1);
+            if(free_nodes.empty()){
+                nodes.push_back(node());
+                r = &nodes.back();
+                r->generation = 0;
+            }else{
+                r = free_nodes.back();
+                free_nodes.pop_back();
+            }
+            r->k = k;
+            r->index = index;
+            r->value = 0;
+            return r;
+        }
+
+        void delete_node(node *n){
+            ++n->generation;
+            free_nodes.push_back(n);
+            nameless_data::line_arena.uncount_external(1);
+        }
+
+        static void link(port a, port b){
+            a.n->link[a.slot] = b;
+            b.n->link[b.slot] = a;
+        }
+
+        static port peer(port p){
+            return p.n->link[p.slot];
+        }
+
+        // 深さlevelの項をネットへ変換する．
+        // 抽象と関数適用の節は一度目に取り出したときに作り，子を変換し終えた二度目に繋ぐ．
+        fragment translate(const term *t, std::size_t level, std::size_t depth){
+            struct frame{
+                const term *t;
+                std::size_t level, depth;
+                node *n;
+            };
+
+            std::vector<frame> frames;
+            std::vector<fragment> results;
+            frames.push_back(frame{t, level, depth, nullptr});
+            while(!frames.empty()){
+                frame f = frames.back();
+                frames.pop_back();
+                switch(f.t->get_kind()){
+                case term::kind::bound:
+                    {
+                        fragment r;
+                        node *c = make_node(node::kind::croissant, f.level);
+                        r.root = port{c, 1};
+                        r.vars[f.depth - 1 - f.t->value] = port{c, 0};
+                        results.push_back(std::move(r));
+                    }
+                    break;
+
+                case term::kind::free:
+                    {
+                        // 自由変数は出現ごとに節を作り，扇や括弧で共有しない．
+                        fragment r;
+                        node *v = make_node(node::kind::free, 0);
+                        v->value = f.t->value;
+                        r.root = port{v, 0};
+                        results.push_back(std::move(r));
+                    }
+                    break;
+
+                case term::kind::abstraction:
+                    if(!f.n){
+                        node *l = make_node(node::kind::lambda, f.level);
+                        l->value = f.t->value;
+                        frames.push_back(frame{f.t, f.level, f.depth, l});
+                        frames.push_back(frame{f.t->lhs, f.level, f.depth + 1, nullptr});
+                    }else{
+                        node *l = f.n;
+                        fragment &body = results.back();
+                        link(port{l, 1}, body.root);
+                        auto iter = body.vars.find(f.depth);
+                        if(iter != body.vars.end()){
+                            link(port{l, 2}, iter->second);
+                            body.vars.erase(iter);
+                        }else{
+                            link(port{l, 2}, port{make_node(node::kind::eraser, 0), 0});
+                        }
+                        body.root = port{l, 0};
+                    }
+                    break;
+
+                case term::kind::application:
+                    if(!f.n){
+                        node *a = make_node(node::kind::application, f.level);
+                        frames.push_back(frame{f.t, f.level, f.depth, a});
+                        frames.push_back(frame{f.t->rhs, f.level + 1, f.depth, nullptr});
+                        frames.push_back(frame{f.t->lhs, f.level, f.depth, nullptr});
+                    }else{
+                        node *a = f.n;
+                        fragment g = std::move(results.back());
+                        results.pop_back();
+                        fragment &r = results.back();
+                        link(port{a, 0}, r.root);
+                        link(port{a, 2}, g.root);
+                        r.root = port{a, 1};
+                        for(auto &i : g.vars){
+                            node *b = make_node(node::kind::bracket, f.level);
+                            link(port{b, 1}, i.second);
+                            auto iter = r.vars.find(i.first);
+                            if(iter != r.vars.end()){
+                                node *fan = make_node(node::kind::fan, f.level);
+                                link(port{fan, 1}, iter->second);
+                                link(port{fan, 2}, port{b, 0});
+                                iter->second = port{fan, 0};
+                            }else{
+                                r.vars.insert(std::make_pair(i.first, port{b, 0}));
+                            }
+                        }
+                    }
+                    break;
+                }
+            }
+            return std::move(results.back());
+        }
+
+        // 主ポートどうしで繋がった二つの節が書き換えられるか．
+        // 自由変数は消去子と制御節とだけ書き換わる．
+        static bool interacts(const node *a, const node *b){
+            if(a->k == node::kind::root || b->k == node::kind::root){
+                return false;
+            }
+            if(a->k == node::kind::free){
+                std::swap(a, b);
+            }
+            return b->k != node::kind::free || a->k == node::kind::eraser || is_control(a->k);
+        }
+
+        // 主ポートどうしで繋がった二つの節を書き換える．
+        void interact(node *a, node *b){
+            ++interactions;
+            if(b->k == node::kind::eraser){
+                std::swap(a, b);
+            }
+            if(a->k == node::kind::eraser){
+                erase(a, b);
+                return;
+            }
+            if(b->k == node::kind::free){
+                std::swap(a, b);
+            }
+            if(a->k == node::kind::free){
+                share(a, b);
+                return;
+            }
+            if(a->k == node::kind::application){
+                std::swap(a, b);
+            }
+            if(a->k == node::kind::lambda && b->k == node::kind::application){
+                if(a->index != b->index){
+                    throw broken_net();
+                }
+                ++betas;
+                annihilate(a, b);
+                return;
+            }
+            if(a->k == b->k && a->index == b->index){
+                annihilate(a, b);
+                return;
+            }
+            if(!is_control(a->k) || (is_control(b->k) && b->index < a->index)){
+                std::swap(a, b);
+            }
+            if(!is_control(a->k) || a->index >= b->index){
+                throw broken_net();
+            }
+            commute(a, b);
+        }
+
+        // 対応する補助ポートどうしを繋いで二つの節を消す．
+        // 消える節の補助ポートが互いに繋がっている場合は繋がりを辿る．
+        void annihilate(node *a, node *b){
+            std::size_t n = arity(a->k);
+            auto removed = [&](port p){
+                return p.n == a || p.n == b;
+            };
+            auto join = [&](port p){
+                return port{p.n == a ? b : a, p.slot};
+            };
+            std::pair<port, port> links[4];
+            std::size_t count = 0;
+            for(node *x : {a, b}){
+                for(std::size_t i = 1; i < n; ++i){
+                    port e = peer(port{x, i});
+                    if(removed(e)){
+                        continue;
+                    }
+                    port y = join(port{x, i});
+                    port z = peer(y);
+                    std::size_t guard = 0;
+                    while(removed(z) && guard++ < 2 * n){
+                        y = join(z);
+                        z = peer(y);
+                    }
+                    if(!removed(z)){
+                        links[count++] = std::make_pair(e, z);
+                    }
+                }
+            }
+            delete_node(a);
+            delete_node(b);
+            for(std::size_t i = 0; i < count; ++i){
+                link(links[i].first, links[i].second);
+            }
+        }
+
+        // aをbの補助ポートへ，bをaの補助ポートへ複製して通過させる．
+        void commute(node *a, node *b){
+            std::size_t na = arity(a->k), nb = arity(b->k);
+            std::size_t b_index = b->index;
+            if(a->k == node::kind::croissant){
+                --b_index;
+            }else if(a->k == node::kind::bracket){
+                ++b_index;
+            }
+            node *as[3] = {}, *bs[3] = {};
+            for(std::size_t r = 1; r < nb; ++r){
+                as[r] = make_node(a->k, a->index);
+                as[r]->value = a->value;
+            }
+            for(std::size_t s = 1; s < na; ++s){
+                bs[s] = make_node(b->k, b_index);
+                bs[s]->value = b->value;
+            }
+            auto replacement = [&](port p){
+                return p.n == a ? port{bs[p.slot], 0} : port{as[p.slot], 0};
+            };
+            std::pair<port, port> links[4];
+            std::size_t count = 0;
+            for(std::size_t r = 1; r < nb; ++r){
+                port e = peer(port{b, r});
+                if(e.n == a || e.n == b){
+                    if(e.n == a || e.slot > r){
+                        links[count++] = std::make_pair(port{as[r], 0}, replacement(e));
+                    }
+                }else{
+                    links[count++] = std::make_pair(port{as[r], 0}, e);
+                }
+            }
+            for(std::size_t s = 1; s < na; ++s){
+                port e = peer(port{a, s});
+                if(e.n == a){
+                    if(e.slot > s){
+                        links[count++] = std::make_pair(port{bs[s], 0}, replacement(e));
+                    }
+                }else if(e.n != b){
+                    links[count++] = std::make_pair(port{bs[s], 0}, e);
+                }
+            }
+            for(std::size_t r = 1; r < nb; ++r){
+                for(std::size_t s = 1; s < na; ++s){
+                    link(port{as[r], s}, port{bs[s], r});
+                }
+            }
+            delete_node(a);
+            delete_node(b);
+            for(std::size_t i = 0; i < count; ++i){
+                link(links[i].first, links[i].second);
+            }
+        }
+
+        // 自由変数を制御節の補助ポートの先へ複製して，制御節を消す．
+        void share(node *v, node *c){
+            std::size_t n = arity(c->k), value = v->value;
+            port targets[2];
             std::size_t count = 0;
-            for(auto &i : variable_seq){
-                r += i.to_str();
-                if(count < variable_seq.size() - 1){
-                    r += " ";
+            for(std::size_t i = 1; i < n; ++i){
+                port p = peer(port{c, i});
+                if(p.n != c){
+                    targets[count++] = p;
+                }
+            }
+            delete_node(v);
+            delete_node(c);
+            for(std::size_t i = 0; i < count; ++i){
+                node *w = make_node(node::kind::free, 0);
+                w->value = value;
+                link(port{w, 0}, targets[i]);
+            }
+        }
+
+        // 消去子で節を消し，補助ポートの先へ消去子を送る．
+        void erase(node *e, node *x){
+            std::size_t n = arity(x->k);
+            port targets[2];
+            std::size_t count = 0;
+            for(std::size_t i = 1; i < n; ++i){
+                port p = peer(port{x, i});
+                if(p.n != x){
+                    targets[count++] = p;
+                }
+            }
+            delete_node(e);
+            delete_node(x);
+            for(std::size_t i = 0; i < count; ++i){
+                link(port{make_node(node::kind::eraser, 0), 0}, targets[i]);
+            }
+        }
+
+        // 深さごとの積み上げ．
+        struct level_cell;
+
+        using level = std::shared_ptr<const level_cell>;
+
+        struct level_cell{
+            enum class tag_t{
+                left,
+                right,
+                mark,
+                pair
+            };
+
+            tag_t tag;
+            level first, second;
+            level next;
+
+            // 長い積み上げを再帰せずに壊す．
+            // 最後の参照を失う子はその場で壊さずに積み，一番外側の破棄で一つずつ壊す．
+            ~level_cell(){
+                static thread_local std::vector<level> dead;
+                static thread_local bool draining = false;
+                for(level *i : {&first, &second, &next}){
+                    if(i->use_count() == 1){
+                        dead.push_back(std::move(*i));
+                    }
+                }
+                if(draining){
+                    return;
+                }
+                draining = true;
+                while(!dead.empty()){
+                    level l = std::move(dead.back());
+                    dead.pop_back();
+                }
+                draining = false;
+            }
+        };
+
+        // 読み戻しの文脈．空でない積み上げだけを深さの大きい順に並べた持続的なリスト．
+        // 制御節の通過で変わるのは通過した深さより上の部分だけなので，下の部分は元の文脈と共有する．
+        struct context_cell;
+
+        using context = std::shared_ptr<const context_cell>;
+
+        struct context_cell{
+            std::size_t index;
+            level l;
+            context next;
+
+            // level_cellと同じく，長いリストを再帰せずに壊す．
+            ~context_cell(){
+                static thread_local std::vector<context> dead;
+                static thread_local bool draining = false;
+                if(next.use_count() == 1){
+                    dead.push_back(std::move(next));
+                }
+                if(draining){
+                    return;
+                }
+                draining = true;
+                while(!dead.empty()){
+                    context c = std::move(dead.back());
+                    dead.pop_back();
+                }
+                draining = false;
+            }
+        };
+
+        // 訪れたλと，そのときの文脈．
+        // previousは同じλを前に訪れた位置．
+        struct visit{
+            const node *n;
+            context ctx;
+            std::size_t previous;
+        };
+
+        static level cons(level_cell::tag_t tag, level first, level second, level next){
+            std::shared_ptr<level_cell> r = std::make_shared<level_cell>();
+            r->tag = tag;
+            r->first = std::move(first);
+            r->second = std::move(second);
+            r->next = std::move(next);
+            return r;
+        }
+
+        static bool equal(const level &a, const level &b){
+            std::vector<std::pair<const level_cell*, const level_cell*>> stack(1, std::make_pair(a.get(), b.get()));
+            while(!stack.empty()){
+                const level_cell *x = stack.back().first, *y = stack.back().second;
+                stack.pop_back();
+                if(x == y){
+                    continue;
+                }
+                if(!x || !y || x->tag != y->tag){
+                    return false;
+                }
+                stack.push_back(std::make_pair(x->first.get(), y->first.get()));
+                stack.push_back(std::make_pair(x->second.get(), y->second.get()));
+                stack.push_back(std::make_pair(x->next.get(), y->next.get()));
+            }
+            return true;
+        }
+
+        static context push(std::size_t index, level l, context next){
+            std::shared_ptr<context_cell> r = std::make_shared<context_cell>();
+            r->index = index;
+            r->l = std::move(l);
+            r->next = std::move(next);
+            return r;
+        }
+
+        // 深さiの積み上げ．
+        static level at(const context &ctx, std::size_t i){
+            const context_cell *c = ctx.get();
+            while(c && c->index > i){
+                c = c->next.get();
+            }
+            return c && c->index == i ? c->l : nullptr;
+        }
+
+        // 深さiからcount個の積み上げをlsで置き換え，その上の深さをずらした文脈を返す．
+        // 作り直すのは深さi以上のセルだけ．
+        context splice(const context &ctx, std::size_t i, std::size_t count, std::initializer_list<level> ls){
+            const context_cell *c = ctx.get();
+            while(c && c->index >= i){
+                above.push_back(c);
+                c = c->next.get();
+            }
+            context r = above.empty() ? ctx : above.back()->next;
+            std::size_t k = i;
+            for(const level &l : ls){
+                if(l){
+                    r = push(k, l, std::move(r));
+                }
+                ++k;
+            }
+            for(auto iter = above.rbegin(); iter != above.rend(); ++iter){
+                if((*iter)->index >= i + count){
+                    r = push((*iter)->index - count + ls.size(), (*iter)->l, std::move(r));
+                }
+            }
+            above.clear();
+            return r;
+        }
+
+        // 制御節の通過．
+        struct crossing{
+            node::kind k;
+            std::size_t index;
+            bool from_principal;
+            std::size_t slot;
+        };
+
+        // 制御節を通過して文脈を変える．
+        // 主ポートから入った場合は抜ける補助ポートをslotへ入れる．
+        void cross(crossing &c){
+            std::size_t i = c.index;
+            switch(c.k){
+            case node::kind::fan:
+                if(c.from_principal){
+                    level l = at(ctx, i);
+                    if(!l || (l->tag != level_cell::tag_t::left && l->tag != level_cell::tag_t::right)){
+                        throw broken_net();
+                    }
+                    ctx = splice(ctx, i, 1, {l->next});
+                    c.slot = l->tag == level_cell::tag_t::left ? 1 : 2;
+                }else{
+                    ctx = splice(ctx, i, 1, {cons(c.slot == 1 ? level_cell::tag_t::left : level_cell::tag_t::right, nullptr, nullptr, at(ctx, i))});
+                }
+                break;
+
+            case node::kind::croissant:
+                if(c.from_principal){
+                    ctx = splice(ctx, i, 1, {});
+                    c.slot = 1;
+                }else{
+                    ctx = splice(ctx, i, 0, {cons(level_cell::tag_t::mark, nullptr, nullptr, nullptr)});
+                }
+                break;
+
+            case node::kind::bracket:
+                if(c.from_principal){
+                    level l = at(ctx, i);
+                    if(!l || l->tag != level_cell::tag_t::pair){
+                        throw broken_net();
+                    }
+                    ctx = splice(ctx, i, 1, {l->first, l->second});
+                    c.slot = 1;
+                }else{
+                    ctx = splice(ctx, i, 2, {cons(level_cell::tag_t::pair, at(ctx, i), at(ctx, i + 1), nullptr)});
+                }
+                break;
+
+            default:
+                throw broken_net();
+            }
+        }
+
+        // 束縛側の文脈と深さindex未満の部分が一致するか調べる．
+        // 共有しているセルに着いたら，そこから下は同じなので比べない．
+        static bool same_scope(const context &a, const context &b, std::size_t index){
+            const context_cell *x = a.get(), *y = b.get();
+            while(x && x->index >= index){
+                x = x->next.get();
+            }
+            while(y && y->index >= index){
+                y = y->next.get();
+            }
+            while(x != y){
+                if(!x || !y || x->index != y->index || !equal(x->l, y->l)){
+                    return false;
+                }
+                x = x->next.get();
+                y = y->next.get();
+            }
+            return true;
+        }
+
+        // 読み戻しで辿る経路の一段．
+        // pは辿っている節のポートで，generationはそこへ来たときの節の世代．
+        // crossedなら制御節cを通過している．
+        // 通過は文脈が要るまで反映せず，反映した段のbeforeに反映する前の文脈を置く．
+        struct frame{
+            port p;
+            std::size_t generation;
+            bool crossed;
+            crossing c;
+            context before;
+        };
+
+        // 読み戻している部分項．根，λの本体，関数適用の引数のどれかから始まる．
+        // framesのbeginの段から次の部分項の始まりまでが，その部分項の頭部への経路になる．
+        // 頭部に着いたらheadに頭部を置き，経路の段を頭部の側から取り除きながら，関数適用の段で引数を読み戻して組み立てる．
+        struct segment{
+            std::size_t begin;
+            bool unwinding;
+            term_ref head;
+        };
+
+        // 保留している制御節の通過を文脈へ反映する．
+        // 主ポートへ抜ける通過は経路を文脈で選ばないので，扇の補助ポートを選ぶときと文脈を比べるときまで遅らせる．
+        void apply(){
+            for(; applied < frames.size(); ++applied){
+                frame &f = frames[applied];
+                if(f.crossed){
+                    f.before = ctx;
+                    cross(f.c);
+                }
+            }
+        }
+
+        // first段目から先の経路を取り除き，制御節の通過を取り消す．
+        void pop_frames(std::size_t first){
+            while(frames.size() > first){
+                if(frames.size() <= applied){
+                    if(frames.back().crossed){
+                        ctx = std::move(frames.back().before);
+                    }
+                    applied = frames.size() - 1;
+                }
+                frames.pop_back();
+            }
+        }
+
+        // λを訪れる．
+        void enter(const node *n){
+            auto iter = last_visits.find(n);
+            visits.push_back(visit{n, ctx, iter == last_visits.end() ? none : iter->second});
+            last_visits[n] = visits.size() - 1;
+        }
+
+        // 最後に訪れたλから出る．
+        void leave(){
+            const visit &v = visits.back();
+            if(v.previous == none){
+                last_visits.erase(v.n);
+            }else{
+                last_visits[v.n] = v.previous;
+            }
+            visits.pop_back();
+        }
+
+        // 一番上の部分項を捨てる．
+        void drop_segment(){
+            std::size_t begin = segments.back().begin;
+            if(frames[begin].p.slot == 1){
+                leave();
+            }
+            pop_frames(begin);
+            segments.pop_back();
+        }
+
+        // 相互作用で消えたk段目の節から先を捨て，一つ手前の段から頭部を探し直す．
+        void invalidate(std::size_t k){
+            while(true){
+                while(segments.back().begin > k){
+                    drop_segment();
+                }
+                segment &s = segments.back();
+                if(k > s.begin){
+                    pop_frames(k);
+                    s.unwinding = false;
+                    s.head = term_ref();
+                    return;
+                }
+
+                // 部分項の始まりの節が消えたら，呼び出した側の経路を探し直す．
+                // λの本体なら呼び出した側の頭部を，引数なら関数適用の段から探し直す．
+                bool body = frames[s.begin].p.slot == 1;
+                drop_segment();
+                if(segments.empty()){
+                    throw broken_net();
+                }
+                if(body){
+                    segments.back().unwinding = false;
+                    segments.back().head = term_ref();
+                    return;
+                }
+                k = frames.size() - 1;
+            }
+        }
+
+        // ネットを根から文脈付きで辿り，名前なしの項へ戻す．
+        // 頭部へ至る経路で出会った相互作用をその場で行うので，必要な簡約だけを最左最外の順に行う．
+        // 相互作用で経路上の節が消えたら，根からではなく消えた節の一つ手前の段から探し直す．
+        term_ref readback(port start){
+            applied = 0;
+            frames.push_back(frame{start, start.n->generation, false, crossing(), nullptr});
+            segments.push_back(segment{0, false, term_ref()});
+            while(true){
+                segment &s = segments.back();
+                frame &f = frames.back();
+                if(f.p.n->generation != f.generation){
+                    invalidate(frames.size() - 1);
+                    continue;
+                }
+                if(s.unwinding){
+                    if(frames.size() - 1 > s.begin){
+                        if(f.p.n->k == node::kind::application && f.p.slot == 0 && !f.crossed){
+                            // 引数を読み戻す．
+                            node *a = f.p.n;
+                            frames.push_back(frame{port{a, 2}, a->generation, false, crossing(), nullptr});
+                            segments.push_back(segment{frames.size() - 1, false, term_ref()});
+                        }else{
+                            pop_frames(frames.size() - 1);
+                        }
+                        continue;
+                    }
+
+                    // 部分項を読み戻し終えた．
+                    node *x = f.p.n;
+                    bool body = f.p.slot == 1;
+                    term_ref r = std::move(s.head);
+                    pop_frames(frames.size() - 1);
+                    segments.pop_back();
+                    if(segments.empty()){
+                        return r;
+                    }
+                    segment &parent = segments.back();
+                    if(body){
+                        leave();
+                        parent.head = nameless_data::make_abstraction(x->value, std::move(r));
+                        parent.unwinding = true;
+                    }else{
+                        parent.head = nameless_data::make_application(std::move(parent.head), std::move(r));
+                        pop_frames(frames.size() - 1);
+                    }
+                    continue;
+                }
+
+                port p = f.p;
+                port q = peer(p);
+                node *x = q.n;
+                if(p.slot == 0 && q.slot == 0 && interacts(p.n, x)){
+                    interact(p.n, x);
+                    if(frames.size() - 1 == s.begin){
+                        throw broken_net();
+                    }
+                    pop_frames(frames.size() - 1);
+                    continue;
+                }
+                switch(x->k){
+                case node::kind::lambda:
+                    if(q.slot == 0){
+                        apply();
+                        enter(x);
+                        frames.push_back(frame{port{x, 1}, x->generation, false, crossing(), nullptr});
+                        segments.push_back(segment{frames.size() - 1, false, term_ref()});
+                    }else if(q.slot == 2){
+                        // 同じλを一度しか訪れていなければ，文脈を比べずにそれが束縛している．
+                        auto iter = last_visits.find(x);
+                        std::size_t i = iter == last_visits.end() ? none : iter->second;
+                        if(i != none && visits[i].previous != none){
+                            apply();
+                            while(i != none && !same_scope(visits[i].ctx, ctx, x->index)){
+                                i = visits[i].previous;
+                            }
+                        }
+                        if(i != none){
+                            s.head = nameless_data::make_bound(visits.size() - 1 - i);
+                        }
+                        if(!s.head){
+                            throw broken_net();
+                        }
+                        s.unwinding = true;
+                    }else{
+                        throw broken_net();
+                    }
+                    break;
+
+                case node::kind::application:
+                    if(q.slot != 1){
+                        throw broken_net();
+                    }
+                    frames.push_back(frame{port{x, 0}, x->generation, false, crossing(), nullptr});
+                    break;
+
+                case node::kind::fan:
+                case node::kind::bracket:
+                case node::kind::croissant:
+                    {
+                        crossing c;
+                        c.k = x->k;
+                        c.index = x->index;
+                        c.from_principal = q.slot == 0;
+                        c.slot = q.slot;
+                        if(c.k == node::kind::fan && c.from_principal){
+                            apply();
+                            frames.push_back(frame{port{x, 0}, x->generation, true, c, ctx});
+                            cross(frames.back().c);
+                            frames.back().p.slot = frames.back().c.slot;
+                            ++applied;
+                        }else{
+                            std::size_t slot = c.from_principal ? 1 : 0;
+                            frames.push_back(frame{port{x, slot}, x->generation, true, c, nullptr});
+                        }
+                    }
+                    break;
+
+                case node::kind::free:
+                    s.head = nameless_data::make_free(x->value);
+                    s.unwinding = true;
+                    break;
+
+                default:
+                    throw broken_net();
+                }
+            }
+        }
+
+        // 読み戻しの状態．
+        static const std::size_t none = std::numeric_limits<std::size_t>::max();
+        context ctx;
+        std::vector<visit> visits;
+        std::unordered_map<const node*, std::size_t> last_visits;
+        std::vector<const context_cell*> above;
+        std::vector<frame> frames;
+        std::size_t applied;
+        std::vector<segment> segments;
+
+        std::deque<node> nodes;
+        std::vector<node*> free_nodes;
+        std::size_t interactions, betas;
+    };
+}
+
+// 仕事を盗み合うスケジューラによる並列の正規化．
+// 頭部正規形まで簡約してから，互いに独立した引数を並列に正規化する．
+namespace parallel_reduction{
+    using nameless_data::term;
+    using nameless_data::term_ref;
+    using nameless_data::reduction_cursor;
+    using nameless_data::import;
+
+    // 仕事．
+    using task = std::function<void()>;
+
+    // スケジューラの中でのスレッドの番号．スケジューラの外のスレッドは0．
+    thread_local std::size_t worker_index = 0;
+
+    // 仕事を盗み合うスレッドの集まり．プログラム全体で一つを使い回す．
+    // 各スレッドは自分の列の末尾から仕事を取り，空なら他のスレッドの列の先頭から盗む．
+    // 仕事が無いスレッドは条件変数で，仕事が積まれるか待っている条件が成り立つまで眠る．
+    class scheduler{
+    public:
+        scheduler(std::size_t threads) : queues(threads), pending(0), stop(false){
+            for(std::size_t i = 1; i < threads; ++i){
+                workers.push_back(std::thread([this, i](){
+                    run(i);
+                }));
+            }
+        }
+
+        scheduler(const scheduler&) = delete;
+
+        ~scheduler(){
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stop = true;
+            }
+            wake.notify_all();
+            for(auto &i : workers){
+                i.join();
+            }
+        }
+
+        // 呼び出したスレッドの列へ仕事を積む．
+        void fork(task t){
+            // 盗まれて数える前に減らされないよう，積む前に数える．
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++pending;
+            }
+            {
+                queue &q = queues[worker_index % queues.size()];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                q.tasks.push_back(std::move(t));
+            }
+            wake.notify_one();
+        }
+
+        // doneが真になるまで，他の仕事を手伝いながら待つ．
+        void wait(const std::atomic<bool> &done){
+            while(!done.load(std::memory_order_acquire)){
+                if(execute(worker_index % queues.size())){
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&](){
+                    return done.load(std::memory_order_acquire) || pending > 0;
+                });
+            }
+        }
+
+        // 待っている条件を成り立たせたことを知らせる．
+        // 眠る直前の判定との間で知らせを取りこぼさないよう，一度ロックを取ってから起こす．
+        void notify(){
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+            }
+            wake.notify_all();
+        }
+
+    private:
+        struct queue{
+            std::mutex mutex;
+            std::deque<task> tasks;
+        };
+
+        // 仕事を一つ取って実行する．仕事が無ければfalseを返す．
+        bool execute(std::size_t index){
+            task t;
+            {
+                queue &q = queues[index];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                if(!q.tasks.empty()){
+                    t = std::move(q.tasks.back());
+                    q.tasks.pop_back();
                 }
-                ++count;
             }
-            r += ". ";
-            r += seq->to_str();
-            return std::move(r);
-        }
-
-        bool equal(const expr *other) const{
-            if(other->get_kind() != expr::kind::lambda){
-                return false;
+            for(std::size_t i = 1; !t && i < queues.size(); ++i){
+                queue &q = queues[(index + i) % queues.size()];
+                std::lock_guard<std::mutex> lock(q.mutex);
+                if(!q.tasks.empty()){
+                    t = std::move(q.tasks.front());
+                    q.tasks.pop_front();
+                }
             }
-            const lambda *other_seq = static_cast<const lambda*>(other);
-            if(variable_seq.size() != other_seq->variable_seq.size()){
+            if(!t){
                 return false;
             }
             {
-                auto iter = variable_seq.begin();
-                for(auto &i : other_seq->variable_seq){
-                    if(!iter->equal(&i)){
-                        return false;
-                    }
-                    ++iter;
-                }
+                std::lock_guard<std::mutex> lock(mutex);
+                --pending;
             }
-            const sequence *s = static_cast<const sequence*>(seq.get());
-            const sequence *other_s = static_cast<const sequence*>(other_seq->seq.get());
-            auto iter = s->vec.begin();
-            for(auto &i : other_s->vec){
-                if(!i->equal(&*i)){
-                    return false;
+            t();
+            return true;
+        }
+
+        void run(std::size_t index){
+            worker_index = index;
+            while(true){
+                if(execute(index)){
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this](){
+                    return stop || pending > 0;
+                });
+                if(stop){
+                    return;
                 }
-                ++iter;
             }
-            return true;
         }
 
-        std::vector<variable> variable_seq;
-        mutable std::unique_ptr<expr> seq;
+        std::vector<queue> queues;
+        std::vector<std::thread> workers;
 
-        sequence *get_seq() const{
-            return static_cast<sequence*>(seq.get());
-        }
+        // 積まれてまだ取られていない仕事の数．mutexで守る．
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::size_t pending;
+        bool stop;
     };
 
-    expr::expr_lookup_table assignment_table;
+    // プログラム全体で使うスケジューラ．初めて呼ばれたときにthreads個のスレッドで作る．
+    scheduler &shared_scheduler(std::size_t threads){
+        static scheduler s(threads);
+        return s;
+    }
 
-    struct step_out{};
+    // 項の節の数をlimitまで数える．
+    std::size_t count_nodes(const term *t, std::size_t limit){
+        std::size_t n = 0;
+        std::vector<const term*> stack(1, t);
+        while(!stack.empty() && n < limit){
+            const term *u = stack.back();
+            stack.pop_back();
+            ++n;
+            if(u->get_kind() == term::kind::application){
+                stack.push_back(u->rhs);
+                stack.push_back(u->lhs);
+            }else if(u->get_kind() == term::kind::abstraction){
+                stack.push_back(u->lhs);
+            }
+        }
+        return n;
+    }
 
-    void global_variable_replace(std::unique_ptr<expr> &e){
-        if(e->get_kind() == expr::kind::variable){
-            variable *var = static_cast<variable*>(e.get());
-            auto iter = assignment_table.find(var->str);
-            if(iter != assignment_table.end()){
-                e.reset(iter->second->copy());
-                global_variable_replace(e);
+    // 頭部正規形まで簡約してから引数を正規化する．
+    // 頭部の簡約はreduction_cursorで進め，簡約した位置から次の簡約基を探す．
+    // 大きな引数は別の確保領域へ写して仕事として積み，一つはそのままこのスレッドで続ける．
+    // 引数を待って止まるスレッドは無く，最後に引数を正規化し終えたスレッドが外側の項を組み立てる．
+    class machine{
+    public:
+        machine(scheduler &pool, std::size_t grain) : pool(pool), grain(grain), steps(0), done(false){}
+        machine(const machine&) = delete;
+
+        // これまでに全てのスレッドで行った簡約の数．
+        std::size_t get_steps() const{
+            return steps;
+        }
+
+        // 項を正規形まで簡約する．
+        term_ref normalize(term_ref t){
+            done = false;
+            reduce(std::move(t), nullptr, 0, &nameless_data::get_arena());
+            pool.wait(done);
+            return std::move(result);
+        }
+
+    private:
+        // 別の確保領域で正規化する引数．
+        // 確保領域ごと捨てるので，resultの参照は数えない．
+        struct job{
+            nameless_data::term_arena arena;
+            term_ref input;
+            const term *result;
+        };
+
+        // 引数の正規形を待っている頭部正規形 /x1 ... xn. h a1 ... am．
+        // lambdasは束縛変数名の記号番号，argsは関数に近い順の引数．
+        // 簡約する前の引数は正規化を始めるときに手放し，作業中の項だけが残るようにする．
+        // headと同じ確保領域で正規化した引数はargsへ，別の確保領域で正規化した引数はjobsの結果に置く．
+        // remainingはまだ届いていない引数の数に，積み終えるまでの分の1を足した数．
+        struct frame{
+            frame *parent;
+            std::size_t position;
+            nameless_data::term_arena *arena;
+            std::vector<std::size_t> lambdas;
+            term_ref head;
+            std::vector<term_ref> args;
+            std::vector<std::unique_ptr<job>> jobs;
+            std::atomic<std::size_t> remaining;
+        };
+
+        // arenaで確保したtを正規化し，parentのposition番目の引数として渡す．parentが無ければ項全体の正規形．
+        void reduce(term_ref t, frame *parent, std::size_t position, nameless_data::term_arena *arena){
+            while(true){
+                {
+                    reduction_cursor cursor(std::move(t), false, true);
+                    cursor.run();
+                    steps += cursor.get_steps();
+                    t = cursor.get();
+                }
+                const term *u = t.get();
+                while(u->get_kind() == term::kind::abstraction){
+                    u = u->lhs;
+                }
+                if(u->get_kind() != term::kind::application){
+                    deliver(std::move(t), parent, position, arena);
+                    return;
+                }
+
+                // 頭部正規形を分解する．
+                frame *f = new frame;
+                f->parent = parent;
+                f->position = position;
+                f->arena = arena;
+                u = t.get();
+                while(u->get_kind() == term::kind::abstraction){
+                    f->lambdas.push_back(u->value);
+                    u = u->lhs;
+                }
+                while(u->get_kind() == term::kind::application){
+                    f->args.push_back(term_ref(u->rhs));
+                    u = u->lhs;
+                }
+                f->head = term_ref(u);
+                t = term_ref();
+                std::reverse(f->args.begin(), f->args.end());
+                f->jobs.resize(f->args.size());
+
+                std::vector<bool> small(f->args.size());
+                std::size_t large = 0;
+                for(std::size_t i = 0; i < f->args.size(); ++i){
+                    small[i] = count_nodes(f->args[i].get(), grain) < grain;
+                    large += small[i] ? 0 : 1;
+                }
+                f->remaining = large + 1;
+
+                // 小さな引数はその場で正規化する．
+                for(std::size_t i = 0; i < f->args.size(); ++i){
+                    if(small[i]){
+                        reduction_cursor cursor(std::move(f->args[i]));
+                        cursor.run();
+                        steps += cursor.get_steps();
+                        f->args[i] = cursor.get();
+                    }
+                }
+
+                // 大きな引数は最初の一つを続けて正規化し，残りを仕事として積む．
+                std::size_t next = f->args.size();
+                for(std::size_t i = 0; i < f->args.size(); ++i){
+                    if(small[i]){
+                        continue;
+                    }
+                    if(next == f->args.size()){
+                        next = i;
+                        continue;
+                    }
+                    job *j = new job;
+                    f->jobs[i].reset(j);
+                    {
+                        nameless_data::arena_switch s(j->arena);
+                        std::map<const term*, term_ref> memo;
+                        j->input = import(f->args[i].get(), memo);
+                    }
+                    f->args[i] = term_ref();
+                    pool.fork([this, f, i, j](){
+                        nameless_data::arena_switch s(j->arena);
+                        reduce(std::move(j->input), f, i, &j->arena);
+                    });
+                }
+
+                if(next == f->args.size()){
+                    // 積み終えた分を引き，全ての引数が届いていれば組み立てる．
+                    if(f->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1){
+                        complete(f);
+                    }
+                    return;
+                }
+                t = std::move(f->args[next]);
+                f->remaining.fetch_sub(1, std::memory_order_acq_rel);
+                parent = f;
+                position = next;
             }
-        }else if(e->get_kind() == expr::kind::lambda){
-            lambda *lam = static_cast<lambda*>(e.get());
-            global_variable_replace(lam->seq);
-        }else if(e->get_kind() == expr::kind::sequence){
-            sequence *seq = static_cast<sequence*>(e.get());
-            for(auto &i : seq->vec){
-                global_variable_replace(i);
+        }
+
+        // 正規形rをparentのposition番目の引数として渡す．parentが無ければ項全体の正規形として渡す．
+        // parentへ渡した後は他のスレッドが組み立てるかもしれないので，arenaの節を持ったまま戻らない．
+        void deliver(term_ref r, frame *parent, std::size_t position, nameless_data::term_arena *arena){
+            if(!parent){
+                finish(std::move(r));
+            }else if(arrive(std::move(r), parent, position, arena)){
+                complete(parent);
             }
         }
-    }
 
-    bool lo_most_reduction(std::unique_ptr<expr> &e){
-        if(e->get_kind() == expr::kind::sequence){
-            sequence *seq = static_cast<sequence*>(e.get());
-            if(seq->vec.size() == 1){
-                e.swap(seq->vec[0]);
-                return true;
+        // 引数を一つ置く．最後の引数ならtrueを返す．
+        static bool arrive(term_ref r, frame *parent, std::size_t position, nameless_data::term_arena *arena){
+            if(parent->arena == arena){
+                parent->args[position] = std::move(r);
             }else{
-                bool mod = false;
-                seq->vec[0].reset(seq->vec[0]->replace(expr::variable_map(), assignment_table, mod));
-                if(seq->vec[0]->get_kind() == expr::kind::lambda){
-                    lambda &lam = *static_cast<lambda*>(seq->vec[0].get());
-                    std::size_t s = (std::min)(lam.variable_seq.size(), seq->vec.size() - 1);
-                    expr::variable_map map;
-                    if(lam.variable_seq.size() <= s){
-                        for(std::size_t i = 0; i < lam.variable_seq.size(); ++i){
-                            map.insert(std::make_pair(lam.variable_seq[i].str, seq->vec[i + 1].get()));
-                        }
-                        {
-                            expr *f = lam.seq->replace(map, assignment_table, mod);
-                            seq->vec.erase(seq->vec.begin(), seq->vec.begin() + s + 1);
-                            seq->vec.insert(seq->vec.begin(), std::move(std::unique_ptr<expr>(f)));
-                        }
-                        if(seq->vec.size() > 1){
-                            return true;
-                        }else{
-                            std::unique_ptr<expr> f(std::move(*seq->vec.begin()));
-                            *seq->vec.begin() = nullptr;
-                            e.swap(f);
-                            return true;
-                        }
-                    }else{
-                        if(s > 0){
-                            for(std::size_t i = 0; i < s; ++i){
-                                map.insert(std::make_pair(lam.variable_seq[i].str, seq->vec[i + 1].get()));
-                            }
-                            std::unique_ptr<expr> f(lam.seq->replace(map, assignment_table, mod));
-                            if(f->get_kind() == expr::kind::sequence){
-                                lam.seq.swap(f);
-                            }else{
-                                lam.get_seq()->vec.clear();
-                                lam.get_seq()->vec.push_back(std::move(f));
-                            }
-                            lam.variable_seq.erase(lam.variable_seq.begin(), lam.variable_seq.begin() + s);
+                parent->jobs[position]->result = r.detach();
+            }
+            return parent->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        }
+
+        // 全ての引数が届いたfを組み立てて外側へ渡す．外側も揃えば続けて組み立てる．
+        void complete(frame *f){
+            while(true){
+                frame *parent = f->parent;
+                std::size_t position = f->position;
+                nameless_data::term_arena *arena = f->arena;
+                term_ref r;
+                {
+                    nameless_data::arena_switch s(*arena);
+                    std::unique_ptr<frame> p(f);
+                    for(std::size_t i = 0; i < p->args.size(); ++i){
+                        if(p->jobs[i]){
+                            std::map<const term*, term_ref> memo;
+                            p->args[i] = import(p->jobs[i]->result, memo);
                         }
-                        e.swap(seq->vec[0]);
-                        return true;
                     }
-                }else{
-                    if(seq->vec[0]->get_kind() == expr::kind::variable){
-                        return lo_most_reduction(seq->vec[0]);
-                    }else{
-                        return lo_most_reduction(seq->vec[0]);
+                    r = std::move(p->head);
+                    for(auto &i : p->args){
+                        r = nameless_data::make_application(std::move(r), std::move(i));
+                    }
+                    for(std::size_t i = p->lambdas.size(); i > 0; --i){
+                        r = nameless_data::make_abstraction(p->lambdas[i - 1], std::move(r));
                     }
                 }
-            }
-        }else if(e->get_kind() == expr::kind::lambda){
-            return lo_most_reduction(static_cast<lambda*>(e.get())->seq);
-        }else if(e->get_kind() == expr::kind::variable){
-            variable *var = static_cast<variable*>(e.get());
-            auto iter = assignment_table.find(var->str);
-            if(iter != assignment_table.end()){
-                e.reset(iter->second->copy());
-                return true;
-            }else{
-                return false;
+                if(!parent){
+                    finish(std::move(r));
+                    return;
+                }
+                if(!arrive(std::move(r), parent, position, arena)){
+                    return;
+                }
+                f = parent;
             }
         }
 
-        // unreached point.
-        return false;
-    }
+        void finish(term_ref r){
+            result = std::move(r);
+            done.store(true, std::memory_order_release);
+            pool.notify();
+        }
 
-    std::vector<std::unique_ptr<expr>> lines;
+        scheduler &pool;
+        std::size_t grain;
+        std::atomic<std::size_t> steps;
+
+        // 項全体の正規形．doneが立ってから読む．
+        term_ref result;
+        std::atomic<bool> done;
+    };
 }
 
 namespace parsing_phase{
-    using token_seq_type = tokenize_phase2::token_seq_type;
-    using token_t = tokenize_phase2::token_t;
+    using token_seq_type = tokenize_phase::token_seq_type;
+    using token_t = tokenize_phase::token_t;
     using kind_t = token_t::kind_t;
 
     token_seq_type::const_iterator expr(std::unique_ptr<internal_data::expr>&, token_seq_type::const_iterator);
     token_seq_type::const_iterator expr_no_sequence(std::unique_ptr<internal_data::expr>&, token_seq_type::const_iterator);
 
-    // p[WOG[D
+    // パージングエラー．
     class parsing_error : public app_exception{
     public:
         parsing_error(std::size_t line) : app_exception("parsing error: " + std::to_string(line + 1)){}
@@ -770,7 +5015,7 @@ namespace parsing_phase{
         ~parsing_error() = default;
     };
 
-    // D
+    // 代入式．
     token_seq_type::const_iterator assignment(std::unique_ptr<internal_data::expr> &e, token_seq_type::const_iterator first){
         token_seq_type::const_iterator iter = first;
         std::string name;
@@ -790,11 +5035,11 @@ namespace parsing_phase{
             return std::move(result);
         }
         e.swap(f);
-        internal_data::assignment_table.insert(std::make_pair(name, std::move(std::unique_ptr<internal_data::expr>(e->copy()))));
+        internal_data::assign(name, std::unique_ptr<internal_data::expr>(e->copy()));
         return result;
     }
 
-    // sD
+    // 行．
     token_seq_type::const_iterator line(token_seq_type::const_iterator first){
         std::unique_ptr<internal_data::expr> e;
         auto result = assignment(e, first);
@@ -808,7 +5053,7 @@ namespace parsing_phase{
         return result;
     }
 
-    // sequenceD
+    // sequence．
     token_seq_type::const_iterator sequence(token_seq_type::const_iterator first, std::unique_ptr<internal_data::expr> &seq){
         token_seq_type::const_iterator iter = first;
         token_seq_type::const_iterator result = expr(seq, iter);
@@ -821,7 +5066,7 @@ namespace parsing_phase{
         return result;
     }
 
-    // lambdaD
+    // lambda．
     token_seq_type::const_iterator lambda(token_seq_type::const_iterator first, internal_data::lambda &lam){
         token_seq_type::const_iterator iter = first;
         if(iter->kind != kind_t::lambda){
@@ -840,176 +5085,547 @@ namespace parsing_phase{
         ++iter;
         token_seq_type::const_iterator result = sequence(iter, lam.seq);
         if(result == iter){
-            // sequencẽp[XsD
+            // sequenceのパース失敗．
+            return first;
+        }
+        return result;
+    }
+
+    // variable．
+    token_seq_type::const_iterator variable(token_seq_type::const_iterator first, internal_data::variable &var){
+        token_seq_type::const_iterator iter = first;
+        if(iter->kind == kind_t::variable){
+            var.str = std::string(iter->beg, iter->end);
+            return ++iter;
+        }else{
             return first;
         }
-        return result;
-    }
+    }
+
+    // 抽象式．
+    // シーケンスを含まない．
+    token_seq_type::const_iterator expr_no_sequence(std::unique_ptr<internal_data::expr> &e, token_seq_type::const_iterator first){
+        token_seq_type::const_iterator iter = first;
+        token_seq_type::const_iterator r = first;
+        if(iter->kind == kind_t::lambda){
+            internal_data::lambda *ptr = new internal_data::lambda();
+            iter = lambda(iter, *ptr);
+            e.reset(ptr);
+            r = iter;
+        }else if(iter->kind == kind_t::variable){
+            internal_data::variable *ptr = new internal_data::variable();
+            iter = variable(iter, *ptr);
+            e.reset(ptr);
+            r = iter;
+        }else if(iter->kind == kind_t::lparen){
+            ++iter;
+            std::unique_ptr<internal_data::expr> f;
+            token_seq_type::const_iterator s = expr(f, iter);
+            if(s != first){
+                iter = s;
+                if(iter->kind == kind_t::rparen){
+                    ++s;
+                    e.swap(f);
+                    r = s;
+                }else{
+                    throw parsing_error(first->line);
+                }
+            }
+        }
+        return r;
+    }
+
+    // 抽象式．
+    // 括弧の中とλの本体の式は段として積み，入れ子の深さによらず再帰しない．
+    // 積んだ段を読み終えたら，その戻り値と式を受け取って元の段の続きを読む．
+    token_seq_type::const_iterator expr(std::unique_ptr<internal_data::expr> &e, token_seq_type::const_iterator first){
+        struct frame{
+            token_seq_type::const_iterator first, iter, r;
+            std::unique_ptr<internal_data::expr> e, seq_expr;
+            internal_data::sequence *seq;
+
+            // 本体を読んでいるλ．nullptrなら括弧の中を読んでいる．
+            // lambda_firstはλの字句の位置，bodyは本体の先頭．
+            internal_data::lambda *lam;
+            token_seq_type::const_iterator lambda_first, body;
+        };
+
+        std::vector<frame> frames;
+        auto enter = [&](token_seq_type::const_iterator iter, std::unique_ptr<internal_data::expr> init){
+            frames.push_back(frame{iter, iter, iter, std::move(init), nullptr, nullptr, nullptr, iter, iter});
+        };
+
+        // 項を一つ読んだ後．式が終わればtrueを返す．
+        auto item = [&](frame &f){
+            if(f.iter->kind == kind_t::dot){
+                ++f.iter;
+                if(f.seq){
+                    f.seq->push_back(std::move(f.e));
+                }
+                return true;
+            }
+            if(!f.seq){
+                f.seq_expr.reset(new internal_data::sequence());
+                f.seq = static_cast<internal_data::sequence*>(f.seq_expr.get());
+            }
+            f.seq->push_back(std::move(f.e));
+            return f.iter->kind == kind_t::rparen;
+        };
+
+        enter(first, std::move(e));
+        token_seq_type::const_iterator result;
+        std::unique_ptr<internal_data::expr> value;
+        bool resumed = false;
+        while(true){
+            frame &f = frames.back();
+            bool done = false, failed = false;
+            if(resumed){
+                resumed = false;
+                if(f.lam){
+                    // λの本体のsequence．
+                    if(result != f.body && value->get_kind() != internal_data::expr::kind::sequence){
+                        internal_data::sequence *wrapper_seq = new internal_data::sequence;
+                        std::unique_ptr<internal_data::expr> wrapper(wrapper_seq);
+                        wrapper_seq->push_back(std::move(value));
+                        value.swap(wrapper);
+                    }
+                    f.lam->seq = std::move(value);
+                    f.lam = nullptr;
+                    // 本体のパースに失敗したらλの字句から進まない．
+                    f.iter = result == f.body ? f.lambda_first : result;
+                    f.r = f.iter;
+                    done = f.iter == f.first || item(f);
+                }else{
+                    if(result != f.first){
+                        f.iter = result;
+                        if(f.iter->kind == kind_t::rparen){
+                            ++f.iter;
+                            f.e.swap(value);
+                            f.r = f.iter;
+                        }else{
+                            throw parsing_error(f.first->line);
+                        }
+                    }
+                    done = item(f);
+                }
+            }else if(f.iter->kind == kind_t::lambda){
+                internal_data::lambda *ptr = new internal_data::lambda();
+                f.e.reset(ptr);
+                token_seq_type::const_iterator iter = f.iter;
+                ++iter;
+                while(iter->kind == kind_t::variable){
+                    internal_data::variable v;
+                    v.str = std::string(iter->beg, iter->end);
+                    ptr->variable_seq.push_back(v);
+                    ++iter;
+                }
+                if(iter->kind == kind_t::dot){
+                    ++iter;
+                    f.lam = ptr;
+                    f.lambda_first = f.iter;
+                    f.body = iter;
+                    enter(iter, std::move(ptr->seq));
+                    continue;
+                }
+                f.r = f.iter;
+                done = f.iter == f.first || item(f);
+            }else if(f.iter->kind == kind_t::variable){
+                internal_data::variable *ptr = new internal_data::variable();
+                f.iter = variable(f.iter, *ptr);
+                f.e.reset(ptr);
+                f.r = f.iter;
+                done = item(f);
+            }else if(f.iter->kind == kind_t::lparen){
+                ++f.iter;
+                f.lam = nullptr;
+                enter(f.iter, nullptr);
+                continue;
+            }else if(f.iter->kind != kind_t::dot){
+                failed = true;
+            }
+
+            if(failed){
+                result = f.first;
+                value = std::move(f.e);
+            }else if(done){
+                if(f.seq){
+                    if(f.seq->vec.size() != 1){
+                        f.e.swap(f.seq_expr);
+                    }else{
+                        f.e.swap(f.seq->vec[0]);
+                    }
+                }
+                result = f.r;
+                value = std::move(f.e);
+            }else{
+                continue;
+            }
+            frames.pop_back();
+            if(frames.empty()){
+                e = std::move(value);
+                return result;
+            }
+            resumed = true;
+        }
+    }
+
+    // 複数行をパースする．
+    bool lines(token_seq_type::const_iterator first){
+        token_seq_type::const_iterator iter = first;
+        token_seq_type::const_iterator jter = iter;
+        for(; (jter = line(iter)) != iter; iter = jter){
+            if(jter->kind == kind_t::dot){
+                ++jter;
+            }
+            if(jter->kind == kind_t::end){
+                break;
+            }
+        }
+        if(jter->kind == kind_t::end){
+            return true;
+        }else{
+            return false;
+        }
+    }
+
+    // 入力を先頭から一文ずつ字句に分ける．
+    // 文は括弧の外にあってλの仮引数を閉じないdotで終わる．
+    // 字句は文の分だけ溜めるので，入力の大きさによらず一文の大きさで済む．
+    class statement_reader{
+    public:
+        statement_reader(const char *first, const char *last) : lex(first, last), scanned(0), depth(0), parameters(false){}
+
+        // 次の文の字句をend字句で閉じてstatementへ入れる．文が残っていなければfalseを返す．
+        bool next(token_seq_type &statement){
+            token_seq_type &tokens = lex.get_tokens();
+            while(true){
+                for(; scanned < lex.get_complete(); ++scanned){
+                    switch(tokens[scanned].kind){
+                    case kind_t::lambda:
+                        parameters = true;
+                        break;
+
+                    case kind_t::lparen:
+                        ++depth;
+                        break;
+
+                    case kind_t::rparen:
+                        if(depth > 0){
+                            --depth;
+                        }
+                        break;
+
+                    case kind_t::dot:
+                        if(parameters){
+                            parameters = false;
+                        }else if(depth == 0){
+                            return cut(statement, scanned + 1);
+                        }
+                        break;
+
+                    case kind_t::end:
+                        return cut(statement, scanned);
+
+                    default:
+                        break;
+                    }
+                }
+                lex.step();
+            }
+        }
+
+        // もう読まない入力の先頭．
+        const char *get_position(){
+            const token_seq_type &tokens = lex.get_tokens();
+            return tokens.empty() ? lex.get_position() : tokens.front().beg;
+        }
+
+    private:
+        bool cut(token_seq_type &statement, std::size_t n){
+            token_seq_type &tokens = lex.get_tokens();
+            if(n == 0){
+                return false;
+            }
+            statement.assign(tokens.begin(), tokens.begin() + n);
+            token_t t = statement.back();
+            t.kind = kind_t::end;
+            t.beg = t.end;
+            statement.push_back(t);
+            lex.drop(n);
+            scanned = 0;
+            depth = 0;
+            parameters = false;
+            return true;
+        }
+
+        tokenize_phase::lexer lex;
+        std::size_t scanned, depth;
+        bool parameters;
+    };
+}
+
+// 解析済みの代入式と式を保存するバイナリ形式．
+// 名前は文字列表へ一度だけ置き，式は前順に並べた語で表す．
+// 語は7ビットずつ下位から並べる可変長の整数で，小さな番号は一バイトで済む．
+// 代入式は名前の番号の語に続けて右辺を置き，その後に式を並べる．
+// 読み込みは写像したファイルの上で直接行うので，字句解析と構文解析を省ける．
+namespace compiled_image{
+    // 形式を変えたらversionを上げる．
+    const char magic[4] = { 'U', 'L', 'C', '\0' };
+    const std::uint32_t version = 1;
+    // 書いた環境とバイト順が違えば，この値が読めない．
+    const std::uint32_t byte_order = 0x01020304;
+
+    // 語の下位2ビットが節の種類，残りが名前の番号か子の数．
+    enum : std::uint32_t{
+        tag_variable = 0,
+        tag_sequence = 1,
+        tag_lambda = 2,
+        tag_bits = 2,
+        tag_mask = 3
+    };
+
+    struct header{
+        char magic[4];
+        std::uint32_t version, byte_order;
+        std::uint32_t string_count, assignment_count, line_count, byte_count;
+    };
+
+    // 壊れたか，別の版のイメージ．
+    class invalid_image : public app_exception{
+    public:
+        invalid_image(std::string msg) : app_exception("invalid compiled image: " + msg){}
+        invalid_image(const invalid_image&) = default;
+        ~invalid_image() override = default;
+    };
+
+    // イメージを書き出せなかった．
+    class write_failed : public app_exception{
+    public:
+        write_failed(std::string path) : app_exception("cannot write compiled image: " + path){}
+        write_failed(const write_failed&) = default;
+        ~write_failed() override = default;
+    };
+
+    bool is_image(const char *first, const char *last){
+        return last - first >= static_cast<std::ptrdiff_t>(sizeof(magic)) && std::equal(magic, magic + sizeof(magic), first);
+    }
+
+    class writer{
+    public:
+        void add_assignment(const std::string &str, const internal_data::expr *e){
+            put(words, name(str));
+            add(e);
+        }
+
+        void add(const internal_data::expr *e){
+            std::vector<const internal_data::expr*> work;
+            work.push_back(e);
+            while(!work.empty()){
+                e = work.back();
+                work.pop_back();
+                if(e->get_kind() == internal_data::expr::kind::variable){
+                    put(words, node(tag_variable, name(static_cast<const internal_data::variable*>(e)->str)));
+                }else if(e->get_kind() == internal_data::expr::kind::sequence){
+                    const auto &vec = static_cast<const internal_data::sequence*>(e)->vec;
+                    put(words, node(tag_sequence, vec.size()));
+                    for(auto iter = vec.rbegin(); iter != vec.rend(); ++iter){
+                        work.push_back(iter->get());
+                    }
+                }else{
+                    const internal_data::lambda *lam = static_cast<const internal_data::lambda*>(e);
+                    put(words, node(tag_lambda, lam->variable_seq.size()));
+                    for(auto &i : lam->variable_seq){
+                        put(words, name(i.str));
+                    }
+                    work.push_back(lam->seq.get());
+                }
+            }
+        }
+
+        void write(const fs::path &path, std::size_t assignment_count, std::size_t line_count) const{
+            header h;
+            std::copy(magic, magic + sizeof(magic), h.magic);
+            h.version = version;
+            h.byte_order = byte_order;
+            h.string_count = static_cast<std::uint32_t>(strings.size());
+            h.assignment_count = static_cast<std::uint32_t>(assignment_count);
+            h.line_count = static_cast<std::uint32_t>(line_count);
+            h.byte_count = static_cast<std::uint32_t>(words.size());
+            // 文字列は長さの語と本体を並べる．
+            std::string table;
+            for(auto str : strings){
+                put(table, static_cast<std::uint32_t>(str->size()));
+                table += *str;
+            }
+            std::ofstream ofile(path.c_str(), std::ios::binary);
+            ofile.write(reinterpret_cast<const char*>(&h), sizeof(h));
+            ofile.write(table.data(), table.size());
+            ofile.write(words.data(), words.size());
+            if(!ofile){
+#ifdef _MSC_VER
+                throw write_failed(wstring_to_string(path.c_str()));
+#else
+                throw write_failed(path.c_str());
+#endif
+            }
+        }
 
-    // variableD
-    token_seq_type::const_iterator variable(token_seq_type::const_iterator first, internal_data::variable &var){
-        token_seq_type::const_iterator iter = first;
-        if(iter->kind == kind_t::variable){
-            var.str = std::string(iter->beg, iter->end);
-            return ++iter;
-        }else{
-            return first;
+    private:
+        static std::uint32_t node(std::uint32_t tag, std::size_t value){
+            return static_cast<std::uint32_t>(value << tag_bits) | tag;
         }
-    }
 
-    // ێD
-    // V[PX܂܂ȂD
-    token_seq_type::const_iterator expr_no_sequence(std::unique_ptr<internal_data::expr> &e, token_seq_type::const_iterator first){
-        token_seq_type::const_iterator iter = first;
-        token_seq_type::const_iterator r = first;
-        if(iter->kind == kind_t::lambda){
-            internal_data::lambda *ptr = new internal_data::lambda();
-            iter = lambda(iter, *ptr);
-            e.reset(ptr);
-            r = iter;
-        }else if(iter->kind == kind_t::variable){
-            internal_data::variable *ptr = new internal_data::variable();
-            iter = variable(iter, *ptr);
-            e.reset(ptr);
-            r = iter;
-        }else if(iter->kind == kind_t::lparen){
-            ++iter;
-            std::unique_ptr<internal_data::expr> f;
-            token_seq_type::const_iterator s = expr(f, iter);
-            if(s != first){
-                iter = s;
-                if(iter->kind == kind_t::rparen){
-                    ++s;
-                    e.swap(f);
-                    r = s;
-                }else{
-                    throw parsing_error(first->line);
-                }
+        static void put(std::string &out, std::uint32_t w){
+            while(w >= 0x80){
+                out += static_cast<char>((w & 0x7f) | 0x80);
+                w >>= 7;
             }
+            out += static_cast<char>(w);
         }
-        return r;
-    }
 
-    // ێD
-    token_seq_type::const_iterator expr(std::unique_ptr<internal_data::expr> &e, token_seq_type::const_iterator first){
-        token_seq_type::const_iterator r;
-        token_seq_type::const_iterator iter = first;
-        internal_data::sequence *seq = nullptr;
-        std::unique_ptr<internal_data::expr> seq_expr(nullptr);
-        while(true){
-            auto case_seq_new = [&](){
-                if(!seq){
-                    seq_expr.reset(new internal_data::sequence());
-                    seq = static_cast<internal_data::sequence*>(seq_expr.get());
-                }
-                seq->push_back(std::move(e));
-            };
+        std::uint32_t name(const std::string &str){
+            auto inserted = string_index.insert(std::make_pair(str, static_cast<std::uint32_t>(strings.size())));
+            if(inserted.second){
+                strings.push_back(&inserted.first->first);
+            }
+            return inserted.first->second;
+        }
 
-            if(iter->kind == kind_t::lambda){
-                internal_data::lambda *ptr = new internal_data::lambda();
-                iter = lambda(iter, *ptr);
-                e.reset(ptr);
-                r = iter;
-                if(iter == first){
-                    break;
-                }
+        std::map<std::string, std::uint32_t> string_index;
+        std::vector<const std::string*> strings;
+        std::string words;
+    };
 
-                if(iter->kind == kind_t::dot){
-                    ++iter;
-                    if(iter->kind == kind_t::end){
-                        ++r;
-                    }
-                    if(seq){
-                        seq->push_back(std::move(e));
-                    }
-                    break;
+    class reader{
+    public:
+        reader(const char *first, const char *last) : iter(first), last(last){
+            if(!is_image(first, last) || last - first < static_cast<std::ptrdiff_t>(sizeof(header))){
+                throw invalid_image("no header.");
+            }
+            std::memcpy(&h, first, sizeof(h));
+            iter += sizeof(h);
+            if(h.byte_order != byte_order){
+                throw invalid_image("byte order differs.");
+            }
+            if(h.version != version){
+                throw invalid_image("version " + std::to_string(h.version) + " is not " + std::to_string(version) + ".");
+            }
+            strings.reserve(std::min<std::size_t>(h.string_count, remaining()));
+            for(std::uint32_t n = 0; n < h.string_count; ++n){
+                const std::uint32_t size = word();
+                if(remaining() < size){
+                    throw invalid_image("truncated string table.");
                 }
-                case_seq_new();
-                if(iter->kind == kind_t::rparen){
-                    break;
+                strings.push_back(std::string(iter, iter + size));
+                iter += size;
+            }
+            if(remaining() != h.byte_count){
+                throw invalid_image("size mismatch.");
+            }
+        }
+
+        const header &get_header() const{
+            return h;
+        }
+
+        std::uint32_t word(){
+            std::uint32_t r = 0;
+            for(unsigned shift = 0; ; shift += 7){
+                if(iter == last || shift > 28){
+                    throw invalid_image("truncated.");
                 }
-            }else if(iter->kind == kind_t::variable){
-                internal_data::variable *ptr = new internal_data::variable();
-                iter = variable(iter, *ptr);
-                e.reset(ptr);
-                r = iter;
-                if(iter == first){
-                    break;
+                const unsigned char c = static_cast<unsigned char>(*iter++);
+                r |= static_cast<std::uint32_t>(c & 0x7f) << shift;
+                if(!(c & 0x80)){
+                    return r;
                 }
+            }
+        }
 
-                if(iter->kind == kind_t::dot){
-                    ++iter;
-                    if(iter->kind == kind_t::end){
-                        ++r;
-                    }
-                    if(seq){
-                        seq->push_back(std::move(e));
+        const std::string &name(std::uint32_t n) const{
+            if(n >= strings.size()){
+                throw invalid_image("name out of range.");
+            }
+            return strings[n];
+        }
+
+        // 前順に並んだ語から式を組み立てる．
+        std::unique_ptr<internal_data::expr> expr(){
+            std::unique_ptr<internal_data::expr> r;
+            std::vector<std::unique_ptr<internal_data::expr>*> work;
+            work.push_back(&r);
+            while(!work.empty()){
+                std::unique_ptr<internal_data::expr> *target = work.back();
+                work.pop_back();
+                const std::uint32_t w = word();
+                const std::uint32_t value = w >> tag_bits;
+                if((w & tag_mask) == tag_variable){
+                    internal_data::variable *var = new internal_data::variable;
+                    target->reset(var);
+                    var->str = name(value);
+                }else if((w & tag_mask) == tag_sequence){
+                    // 子は一つにつき一バイト以上あるので，残りのバイト数より多くはない．
+                    if(value > remaining()){
+                        throw invalid_image("truncated.");
                     }
-                    break;
-                }
-                case_seq_new();
-                if(iter->kind == kind_t::rparen){
-                    break;
-                }
-            }else if(iter->kind == kind_t::lparen){
-                if(iter->kind == kind_t::lparen){
-                    ++iter;
-                    std::unique_ptr<internal_data::expr> f;
-                    token_seq_type::const_iterator s = expr(f, iter);
-                    if(s != first){
-                        iter = s;
-                        if(iter->kind == kind_t::rparen){
-                            ++s;
-                            ++iter;
-                            e.swap(f);
-                            r = s;
-                        }else{
-                            throw parsing_error(first->line);
-                        }
+                    internal_data::sequence *seq = new internal_data::sequence;
+                    target->reset(seq);
+                    seq->vec.resize(value);
+                    for(std::size_t n = value; n > 0; --n){
+                        work.push_back(&seq->vec[n - 1]);
                     }
-                }
-
-                if(iter->kind == kind_t::dot){
-                    ++iter;
-                    if(iter->kind == kind_t::end){
-                        ++r;
+                }else if((w & tag_mask) == tag_lambda){
+                    if(value > remaining()){
+                        throw invalid_image("truncated.");
                     }
-                    if(seq){
-                        seq->push_back(std::move(e));
+                    internal_data::lambda *lam = new internal_data::lambda;
+                    target->reset(lam);
+                    lam->variable_seq.resize(value);
+                    for(auto &i : lam->variable_seq){
+                        i.str = name(word());
                     }
-                    break;
-                }
-                case_seq_new();
-                if(iter->kind == kind_t::rparen){
-                    break;
+                    work.push_back(&lam->seq);
+                }else{
+                    throw invalid_image("unknown node.");
                 }
-            }else if(iter->kind != kind_t::dot){
-                return first;
             }
+            return r;
         }
-        if(seq){
-            if(seq->vec.size() != 1){
-                e.swap(seq_expr);
-            }else{
-                e.swap(seq->vec[0]);
-            }
+
+    private:
+        std::size_t remaining() const{
+            return static_cast<std::size_t>(last - iter);
         }
-        return r;
+
+        const char *iter, *last;
+        header h;
+        std::vector<std::string> strings;
+    };
+
+    // 代入式の表と式の列をpathへ書き出す．
+    void write(const fs::path &path){
+        writer w;
+        for(auto &i : internal_data::assignment_table){
+            w.add_assignment(i.first, i.second.get());
+        }
+        for(auto &i : internal_data::lines){
+            w.add(i.get());
+        }
+        w.write(path, internal_data::assignment_table.size(), internal_data::lines.size());
     }
 
-    // sp[XD
-    bool lines(token_seq_type::const_iterator first){
-        token_seq_type::const_iterator iter = first;
-        token_seq_type::const_iterator jter = iter;
-        for(; (jter = line(iter)) != iter && jter->kind != kind_t::end; iter = jter){
-            if(jter->kind == kind_t::dot){
-                ++jter;
-            }
+    // イメージの代入式を登録し，definitions_onlyでなければ式も加える．
+    void read(const char *first, const char *last, bool definitions_only){
+        reader r(first, last);
+        for(std::uint32_t n = 0; n < r.get_header().assignment_count; ++n){
+            const std::string &name = r.name(r.word());
+            internal_data::assign(name, r.expr());
         }
-        if(jter->kind == kind_t::end){
-            return true;
-        }else{
-            return false;
+        if(!definitions_only){
+            for(std::uint32_t n = 0; n < r.get_header().line_count; ++n){
+                internal_data::lines.push_back(r.expr());
+            }
         }
     }
 }
@@ -1021,6 +5637,111 @@ public:
     ~parsing_failed() override = default;
 };
 
+// 前置きの代入式を読み込む．コンパイル済みのイメージでも式のテキストでもよく，式は評価しない．
+void load_prelude(const fs::path &path){
+    check_file_exist(path);
+    mapped_file input(path);
+    if(compiled_image::is_image(input.begin(), input.end())){
+        compiled_image::read(input.begin(), input.end(), true);
+    }else{
+        auto b = tokenize_phase::tokenize(input.begin(), input.end());
+        if(!parsing_phase::lines(b.begin())){
+            throw parsing_failed();
+        }
+        internal_data::lines.clear();
+    }
+}
+
+// 未知の評価器．
+class unknown_engine : public app_exception{
+public:
+    unknown_engine(std::string name) : app_exception("unknown engine: " + name){}
+    unknown_engine(const unknown_engine&) = default;
+    ~unknown_engine() override = default;
+};
+
+// 不正な数値の指定．
+class invalid_number : public app_exception{
+public:
+    invalid_number(std::string option, std::string value) : app_exception("invalid number for " + option + ": " + value){}
+    invalid_number(const invalid_number&) = default;
+    ~invalid_number() override = default;
+};
+
+// 値を取るプログラムスイッチを正の数として読む．指定が無ければdefault_valueを返す．
+std::size_t number_value(const std::string &option, std::size_t default_value){
+    auto iter = program_values.find(option);
+    if(iter == program_values.end()){
+        return default_value;
+    }
+    const std::string &value = iter->second;
+    if(value.empty() || value.find_first_not_of("0123456789") != std::string::npos || std::stoul(value) == 0){
+        throw invalid_number(option, value);
+    }
+    return std::stoul(value);
+}
+
+// 並列の正規化で使うスレッド数．
+std::size_t parallel_threads(){
+    return number_value("--threads", std::max(1u, std::thread::hardware_concurrency()));
+}
+
+// 資源の上限はnormalでのみ扱える．
+class unsupported_limits : public app_exception{
+public:
+    unsupported_limits(std::string engine) : app_exception("resource limits are not supported by engine: " + engine){}
+    unsupported_limits(const unsupported_limits&) = default;
+    ~unsupported_limits() override = default;
+};
+
+// 一つの式の評価に使える資源の上限．
+// 指定の無い上限は0で，制限しない．
+class resource_governor{
+public:
+    // 簡約の段数以外の上限を調べる間隔．
+    static const std::size_t check_interval = 64;
+
+    resource_governor() :
+        max_steps(number_value("--max-steps", 0)),
+        max_time(number_value("--max-time", 0)),
+        max_nodes(number_value("--max-nodes", 0)),
+        start(std::chrono::steady_clock::now())
+    {}
+
+    bool limited() const{
+        return max_steps || max_time || max_nodes;
+    }
+
+    // 次に上限を調べるまでに進めてよい段数．
+    std::size_t budget(const nameless_data::reduction_cursor &cursor) const{
+        std::size_t r = max_steps ? max_steps - cursor.get_steps() : std::numeric_limits<std::size_t>::max();
+        if(max_time || max_nodes){
+            r = std::min(r, check_interval);
+        }
+        return r;
+    }
+
+    // 上限に達していればその資源の名前を，そうでなければnullptrを返す．
+    const char *exceeded(const nameless_data::reduction_cursor &cursor) const{
+        if(max_steps && cursor.get_steps() >= max_steps){
+            return "step";
+        }
+        if(max_nodes && nameless_data::get_arena().get_live() + cursor.get_pending() > max_nodes){
+            return "node";
+        }
+        if(max_time && std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(max_time)){
+            return "time";
+        }
+        return nullptr;
+    }
+
+private:
+    std::size_t max_steps, max_time, max_nodes;
+    std::chrono::steady_clock::time_point start;
+};
+
+const std::size_t resource_governor::check_interval;
+
 int waiting(){
 #ifdef _MSC_VER
     return getch();
@@ -1039,31 +5760,27 @@ void launch_interpreter(){
         }
 
         try{
-            std::vector<char> line_raw(line.begin(), line.end());
-            auto b = tokenize_phase2::tokenize(tokenize_phase1::tokenize(line_raw));
+            auto b = tokenize_phase::tokenize(line.data(), line.data() + line.size());
             if(!parsing_phase::lines(b.begin())){
                 throw parsing_failed();
             }
+            nameless_data::lower_assignments();
             for(auto &i : internal_data::lines){
-                bool mod;
-                std::unique_ptr<internal_data::expr> q(i->replace(internal_data::expr::variable_map(), internal_data::assignment_table, mod));
-                internal_data::global_variable_replace(q);
-
-                while(true){
-                    try{
-                        int nest_level = 0;
-                        if(internal_data::lo_most_reduction(q)){
-                            std::cout << " = " << q->to_str() << "." << std::endl;
-                            throw internal_data::step_out();
-                        }
-                    }catch(internal_data::step_out){
-                        std::cout << " = " << q->to_str() << "." << std::endl;
-                        if(waiting() == 'c'){
-                            break;
-                        }
+                nameless_data::arena_release release(nameless_data::line_arena);
+                nameless_data::reduction_cursor cursor(nameless_data::lower(i.get()));
+
+                nameless_data::step_status status;
+                while((status = cursor.step()) != nameless_data::step_status::normal_form){
+                    // 代入式の右辺を正規化する段では項全体は変わらない．
+                    if(status == nameless_data::step_status::definition){
                         continue;
                     }
-                    break;
+                    std::cout << " = ";
+                    nameless_data::print(std::cout, cursor.get().get(), 0);
+                    std::cout << "." << std::endl;
+                    if(waiting() == 'c'){
+                        break;
+                    }
                 }
             }
         }catch(app_exception e){
@@ -1072,6 +5789,268 @@ void launch_interpreter(){
     }
 }
 
+// 評価した全ての式の数と簡約の段数．
+std::atomic<std::size_t> evaluated_lines(0), reduction_steps(0);
+
+// 一つの式を評価して結果をoutへ，確保領域の統計をerrへ出力する．
+// indexは式の通し番号で，結果の部分項をまとめた代入式の名前に使う．
+void evaluate_line(const internal_data::expr *e, std::size_t index, const std::string &engine, normalization_by_evaluation::evaluator &nbe, std::ostream &out, std::ostream &err){
+    bool program_swtich_s = program_switchs.find("-s") != program_switchs.end();
+    bool program_swtich_b = program_switchs.find("-b") != program_switchs.end();
+    bool program_swtich_arena_stats = program_switchs.find("--arena-stats") != program_switchs.end();
+    bool program_swtich_detect_cycles = program_switchs.find("--detect-cycles") != program_switchs.end();
+    bool program_swtich_share = program_switchs.find("--share") != program_switchs.end();
+    std::size_t print_limit = number_value("--max-print", 0);
+    nameless_data::arena_release release(nameless_data::line_arena);
+    resource_governor governor;
+    const char *exceeded = nullptr;
+    std::size_t cycle = 0;
+    std::size_t steps = 0;
+    if(program_swtich_b || program_swtich_s){
+        internal_data::print(out, e, print_limit);
+        out << std::endl;
+        if(program_swtich_s){
+            waiting();
+        }
+        // 展開した式は表示するだけで，評価は展開していない式から始める．
+        std::unique_ptr<internal_data::expr> q(e->copy());
+        internal_data::global_variable_replace(q);
+        internal_data::print(out, q.get(), print_limit);
+        out << std::endl;
+        if(program_swtich_s){
+            waiting();
+        }
+    }
+    nameless_data::term_ref t(nameless_data::lower(e));
+    if(engine == "need"){
+        graph_reduction::machine m;
+        t = m.normalize(t);
+        steps = m.get_steps();
+    }else if(engine == "krivine"){
+        krivine_machine::machine m;
+        t = m.whnf(t);
+        steps = m.get_steps();
+    }else if(engine == "nbe"){
+        std::size_t before = nbe.get_steps();
+        t = nbe.normalize(t);
+        steps = nbe.get_steps() - before;
+    }else if(engine == "optimal"){
+        interaction_net::net n;
+        t = n.normalize(t);
+        steps = n.get_betas();
+    }else if(engine == "parallel"){
+        parallel_reduction::machine m(parallel_reduction::shared_scheduler(parallel_threads()), number_value("--grain", 256));
+        t = m.normalize(t);
+        steps = m.get_steps();
+    }else{
+        nameless_data::reduction_cursor cursor(std::move(t), nameless_data::use_memo);
+        nameless_data::cycle_detector detector(cursor);
+        if(program_swtich_s){
+            nameless_data::step_status status;
+            while((status = cursor.step()) != nameless_data::step_status::normal_form){
+                // 代入式の右辺を正規化する段では項全体は変わらないので表示しない．
+                if(status == nameless_data::step_status::progressed){
+                    nameless_data::print(out, cursor.get().get(), print_limit);
+                    out << "." << std::endl;
+                    waiting();
+                }
+                if(program_swtich_detect_cycles && (cycle = detector.check(cursor))){
+                    break;
+                }
+                if((exceeded = governor.exceeded(cursor))){
+                    break;
+                }
+            }
+        }else{
+            // 閉路を探すときは一段ごとに調べる．
+            std::size_t chunk = program_swtich_detect_cycles ? 1 : std::numeric_limits<std::size_t>::max();
+            while(cursor.run(std::min(chunk, governor.budget(cursor))) == nameless_data::step_status::budget_exhausted){
+                if(program_swtich_detect_cycles && (cycle = detector.check(cursor))){
+                    break;
+                }
+                if((exceeded = governor.exceeded(cursor))){
+                    break;
+                }
+            }
+        }
+        steps = cursor.get_steps();
+        t = cursor.get();
+    }
+    ++evaluated_lines;
+    reduction_steps += steps;
+    // 共有する部分項は代入式として先に書き出す．
+    std::map<const nameless_data::term*, std::string> names;
+    if(program_swtich_share){
+        for(const nameless_data::term *s : nameless_data::share(t.get(), "share" + std::to_string(index) + "_", names)){
+            out << names[s] << " = ";
+            nameless_data::print(out, s, print_limit, &names);
+            out << "." << std::endl;
+        }
+    }
+    if(program_swtich_b || program_swtich_s){
+        out << "-> ";
+    }
+    nameless_data::print(out, t.get(), print_limit, &names);
+    out << "." << std::endl;
+    if(exceeded){
+        // 上限に達した式は途中までの結果を表示して次の式へ進む．
+        err << "untyped lambda: " << exceeded << " limit exceeded after " << steps << " steps. the result is partial." << std::endl;
+    }
+    if(cycle){
+        err << "untyped lambda: diverges (cycle of length " << cycle << " at step " << steps << "). the result is partial." << std::endl;
+    }
+    if(program_swtich_arena_stats){
+        err << "arena: " << nameless_data::line_arena.get_peak() << " nodes peak, " << nameless_data::line_arena.get_capacity() << " nodes reserved." << std::endl;
+    }
+}
+
+// 並列評価での一つの式の結果．
+struct line_result{
+    std::string out, err;
+    std::exception_ptr error;
+    bool done;
+};
+
+// 各式をjobs個のスレッドで評価し，結果を元の順にoutputへ出力する．
+// 各スレッドの確保領域の最大使用節数を返し，評価器が外に作った節も合わせた最大数をpeak_nodesに入れる．
+std::size_t evaluate_lines_in_parallel(const std::string &engine, std::size_t jobs, std::ostream &output, std::size_t &peak_nodes){
+    for(auto &i : internal_data::lines){
+        nameless_data::intern_symbols(i.get());
+    }
+
+    std::vector<line_result> results(internal_data::lines.size());
+    for(auto &i : results){
+        i.done = false;
+    }
+    std::vector<std::size_t> high_water(jobs, 0), node_high_water(jobs, 0);
+    std::atomic<std::size_t> next(0);
+    std::atomic<bool> stop(false);
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::vector<std::thread> workers;
+    for(std::size_t w = 0; w < jobs; ++w){
+        workers.push_back(std::thread([&, w](){
+            normalization_by_evaluation::evaluator nbe;
+            while(!stop){
+                std::size_t n = next++;
+                if(n >= results.size()){
+                    break;
+                }
+                std::ostringstream out, err;
+                std::exception_ptr error;
+                try{
+                    evaluate_line(internal_data::lines[n].get(), n + 1, engine, nbe, out, err);
+                }catch(...){
+                    error = std::current_exception();
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                results[n].out = out.str();
+                results[n].err = err.str();
+                results[n].error = error;
+                results[n].done = true;
+                ready.notify_all();
+            }
+            high_water[w] = nameless_data::line_arena.get_high_water();
+            node_high_water[w] = nameless_data::line_arena.get_node_high_water();
+        }));
+    }
+
+    std::exception_ptr error;
+    for(std::size_t n = 0; n < results.size(); ++n){
+        line_result r;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [&](){ return results[n].done; });
+            r = std::move(results[n]);
+        }
+        output << r.out;
+        std::cerr << r.err;
+        if(r.error){
+            error = r.error;
+            stop = true;
+            break;
+        }
+    }
+    for(auto &i : workers){
+        i.join();
+    }
+    if(error){
+        std::rethrow_exception(error);
+    }
+    std::size_t r = 0;
+    for(auto i : high_water){
+        r = std::max(r, i);
+    }
+    peak_nodes = 0;
+    for(auto i : node_high_water){
+        peak_nodes = std::max(peak_nodes, i);
+    }
+    return r;
+}
+
+// プロセスの最大常駐メモリ量．KB単位．
+std::size_t max_rss_kb(){
+#ifdef _MSC_VER
+    PROCESS_MEMORY_COUNTERS counters;
+    GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// JSONの文字列にする．
+std::string json_string(const std::string &str){
+    std::string r = "\"";
+    for(char c : str){
+        if(c == '"' || c == '\\'){
+            r += '\\';
+            r += c;
+        }else if(static_cast<unsigned char>(c) < 0x20){
+            char buffer[8];
+            std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            r += buffer;
+        }else{
+            r += c;
+        }
+    }
+    return r + "\"";
+}
+
+// 入力全体の評価の計測結果を一つのJSONのオブジェクトとしてoutへ出力する．
+// peak_nodesは項の節と評価器が作った節を合わせた最大数で，数えられない評価器では渡さない．
+// 評価に失敗していればerrorにその理由を渡す．
+void report_benchmark(std::ostream &out, const std::string &path, const std::string &engine, std::chrono::steady_clock::time_point start, boost::optional<std::size_t> peak_nodes, const char *error){
+    double wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    out << "{\"file\": " << json_string(path);
+    out << ", \"engine\": " << json_string(engine);
+    out << ", \"formulas\": " << evaluated_lines;
+    out << ", \"wall_ms\": " << std::fixed << std::setprecision(3) << wall_ms;
+    out << ", \"steps\": " << reduction_steps;
+    if(peak_nodes){
+        out << ", \"peak_nodes\": " << *peak_nodes;
+    }
+    out << ", \"max_rss_kb\": " << max_rss_kb();
+    if(error){
+        out << ", \"error\": " << json_string(error);
+    }
+    out << "}" << std::endl;
+}
+
+// parallelは引数ごとの確保領域を別のスレッドで使うので，節の最大数を数えられない．
+boost::optional<std::size_t> bench_peak_nodes(const std::string &engine, std::size_t peak_nodes){
+    if(engine == "parallel"){
+        return boost::none;
+    }
+    return peak_nodes;
+}
+
 int main(int argc, char *argv[]){
     if(argc <= 1){
         launch_interpreter();
@@ -1092,6 +6071,10 @@ int main(int argc, char *argv[]){
                 program_switchs.erase(iter);
             }
         }
+        if(takes_value(str)){
+            program_values[str] = i + 1 < argc ? argv[++i] : "";
+            continue;
+        }
         program_switchs.insert(str);
     }
 
@@ -1101,68 +6084,153 @@ int main(int argc, char *argv[]){
         std::cout << "  untyped_lambda ifile_path.txt {option}" << std::endl;
         std::cout << std::endl;
         std::cout << "option:" << std::endl;
-        // wvbZ[W\D
+        // ヘルプメッセージを表示する．
         std::cout << "  --help:" << std::endl;
         std::cout << "      -h: show this message." << std::endl;
-        // e̕]O̒l\D
+        // 各式の評価前の値を表示する．
         std::cout << "      -b: show before evaluation of fomulas. [default]" << std::endl;
-        // e̕]ʂ̂ݕ\D
+        // 各式の評価結果のみ表示する．
         std::cout << "      -o: show only evaluation results." << std::endl;
-        // ̕]ƂɈꎞ~D
-        std::cout << "      -s: step evaluation." << std::endl << std::endl;
+        // 式の評価ごとに一時停止する．
+        std::cout << "      -s: step evaluation." << std::endl;
+        // 項の確保領域の最大使用量を表示する．
+        std::cout << "  --arena-stats: report arena high-water marks to stderr." << std::endl;
+        // 式を並列に評価する．
+        std::cout << "  -j N: evaluate formulas on N threads. results keep source order." << std::endl;
+        // 評価器を選ぶ．
+        std::cout << "  --engine name: select evaluation engine." << std::endl;
+        std::cout << "      normal: leftmost outermost reduction. [default]" << std::endl;
+        std::cout << "      need: call-by-need graph reduction." << std::endl;
+        std::cout << "      krivine: weak head normal form by Krivine machine." << std::endl;
+        std::cout << "      nbe: normalization by evaluation." << std::endl;
+        std::cout << "      optimal: optimal reduction by interaction nets." << std::endl;
+        std::cout << "      parallel: normalize independent subterms on a work-stealing scheduler." << std::endl;
+        // 並列の正規化で使うスレッド数．
+        std::cout << "  --threads N: threads for the parallel engine. [default: number of cores]" << std::endl;
+        // 並列に正規化する部分項の最小の節数．
+        std::cout << "  --grain N: smallest subterm forked by the parallel engine. [default: 256]" << std::endl;
+        // 一つの式の評価に使える資源の上限．
+        std::cout << "  --max-steps N: stop a formula after N reduction steps. (normal engine)" << std::endl;
+        std::cout << "  --max-time N: stop a formula after N milliseconds. (normal engine)" << std::endl;
+        std::cout << "  --max-nodes N: stop a formula when more than N term nodes are live. (normal engine)" << std::endl;
+        // 表示する式の大きさの上限．
+        std::cout << "  --max-print N: print at most N names of each formula and result, then \"...\"." << std::endl;
+        // 結果の共有された部分項を代入式にまとめる．
+        std::cout << "  --share: print closed subterms that occur more than once in a result as assignments before it." << std::endl;
+        // 代入式の右辺を正規形にしてから展開する．
+        std::cout << "  --cache-definitions: normalize each definition once on first use. (normal engine)" << std::endl;
+        // 正規化した部分項を表に覚えて全ての式で共有する．
+        std::cout << "  --memo: share normal forms of subterms across formulas, up to alpha-equivalence. (normal engine)" << std::endl;
+        // 簡約が以前の項へ戻ったら評価を打ち切る．
+        std::cout << "  --detect-cycles: stop a formula when it reduces back to an earlier term. (normal engine)" << std::endl;
+        // 一文ずつ読んで評価し，ファイルの全体を保持しない．
+        std::cout << "  --stream: read, evaluate and print one statement at a time. definitions apply to later statements only." << std::endl;
+        // 解析した代入式と式をイメージへ書き出す．イメージは入力ファイルとして読める．
+        std::cout << "  --compile path: write parsed definitions and formulas to a compiled image instead of evaluating." << std::endl;
+        // 代入式だけを先に読み込む．
+        std::cout << "  --prelude path: load definitions from a compiled image or a source file before the input." << std::endl;
+        // 結果を表示する代わりに，評価の計測結果をJSONで表示する．
+        std::cout << "  --bench: discard results and print wall time, steps, peak term nodes and max RSS as JSON." << std::endl << std::endl;
 
         return 0;
     }
 
+    // 計測するときは結果を捨てる．
+    bool program_swtich_bench = program_switchs.find("--bench") != program_switchs.end();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::ostream discard(nullptr);
+    std::ostream &output = program_swtich_bench ? discard : std::cout;
     try{
+        if(program_values.count("--prelude")){
+            load_prelude(program_values["--prelude"]);
+        }
         const fs::path ifile_path(argv[1]);
         check_file_exist(ifile_path);
-        std::vector<char> str = open_file(ifile_path);
-        auto a = tokenize_phase1::tokenize(str);
-        auto b = tokenize_phase2::tokenize(a);
-        if(!parsing_phase::lines(b.begin())){
-            throw parsing_failed();
+        mapped_file input(ifile_path);
+        bool image = compiled_image::is_image(input.begin(), input.end());
+        bool program_swtich_compile = program_values.count("--compile") > 0;
+        // イメージの読み込みとイメージへの書き出しは，全ての式をまとめて扱う．
+        bool program_swtich_stream = program_switchs.find("--stream") != program_switchs.end() && !image && !program_swtich_compile;
+        if(image){
+            compiled_image::read(input.begin(), input.end(), false);
+        }else if(!program_swtich_stream){
+            auto b = tokenize_phase::tokenize(input.begin(), input.end());
+            if(!parsing_phase::lines(b.begin())){
+                throw parsing_failed();
+            }
+        }
+        if(program_swtich_compile){
+            compiled_image::write(program_values["--compile"]);
+            return 0;
+        }
+
+        std::string engine = program_values.count("--engine") ? program_values["--engine"] : "normal";
+        if(engine != "normal" && engine != "need" && engine != "krivine" && engine != "nbe" && engine != "optimal" && engine != "parallel"){
+            throw unknown_engine(engine);
+        }
+
+        // 資源の上限の指定は評価を始める前に検査する．
+        if(resource_governor().limited() && engine != "normal"){
+            throw unsupported_limits(engine);
         }
 
+        nameless_data::cache_definitions = program_switchs.find("--cache-definitions") != program_switchs.end();
+        nameless_data::use_memo = program_switchs.find("--memo") != program_switchs.end();
+        nameless_data::lower_assignments();
+
         bool program_swtich_s = program_switchs.find("-s") != program_switchs.end();
-        bool program_swtich_b = program_switchs.find("-b") != program_switchs.end();
-        for(auto &i : internal_data::lines){
-            std::unique_ptr<internal_data::expr> q((i->copy()));
-            if(program_swtich_b || program_swtich_s){
-                std::cout << i->to_str() << std::endl;
-                if(program_swtich_s){
-                    waiting();
+        bool program_swtich_arena_stats = program_switchs.find("--arena-stats") != program_switchs.end();
+        // 数値の指定は評価を始める前に検査する．
+        std::size_t jobs = number_value("-j", 1);
+        parallel_threads();
+        number_value("--grain", 1);
+        number_value("--max-print", 1);
+
+        std::size_t high_water, peak_nodes;
+        if(program_swtich_stream){
+            // 一文ずつ読んではすぐに評価して出力する．
+            // 代入式はその文より後の式からしか参照できない．
+            parsing_phase::statement_reader reader(input.begin(), input.end());
+            parsing_phase::token_seq_type statement;
+            normalization_by_evaluation::evaluator nbe;
+            std::size_t index = 0;
+            while(reader.next(statement)){
+                if(!parsing_phase::lines(statement.begin())){
+                    throw parsing_failed();
                 }
-                internal_data::global_variable_replace(q);
-                std::cout << q->to_str() << std::endl;
-                if(program_swtich_s){
-                    waiting();
+                if(nameless_data::lower_assignments()){
+                    nbe.clear_globals();
                 }
-            }
-            while(true){
-                try{
-                    int nest_level = 0;
-                    bool mod = false;
-                    //internal_data::eval2(q, true, mod, true);
-                    if(internal_data::lo_most_reduction(q)){
-                        throw internal_data::step_out();
-                    }
-                }catch(internal_data::step_out){
-                    if(program_swtich_s){
-                        std::cout << q->to_str() << "." << std::endl;
-                        waiting();
-                    }
-                    continue;
+                for(auto &i : internal_data::lines){
+                    evaluate_line(i.get(), ++index, engine, nbe, output, std::cerr);
                 }
-                break;
+                internal_data::lines.clear();
+                input.release(reader.get_position());
             }
-            if(program_swtich_b || program_swtich_s){
-                std::cout << "-> ";
+            high_water = nameless_data::line_arena.get_high_water();
+            peak_nodes = nameless_data::line_arena.get_node_high_water();
+        }else if(jobs == 1 || program_swtich_s){
+            normalization_by_evaluation::evaluator nbe;
+            for(std::size_t n = 0; n < internal_data::lines.size(); ++n){
+                evaluate_line(internal_data::lines[n].get(), n + 1, engine, nbe, output, std::cerr);
             }
-            std::cout << q->to_str() << "." << std::endl;
+            high_water = nameless_data::line_arena.get_high_water();
+            peak_nodes = nameless_data::line_arena.get_node_high_water();
+        }else{
+            high_water = evaluate_lines_in_parallel(engine, jobs, output, peak_nodes);
+        }
+        if(program_swtich_arena_stats){
+            std::cerr << "arena: " << high_water << " nodes high-water, " << nameless_data::definition_arena.get_high_water() << " nodes in definitions." << std::endl;
+        }
+        if(program_swtich_bench){
+            report_benchmark(std::cout, argv[1], engine, start, bench_peak_nodes(engine, peak_nodes), nullptr);
         }
     }catch(app_exception e){
         std::cerr << e.what() << std::endl;
+        if(program_swtich_bench){
+            std::string engine = program_values.count("--engine") ? program_values["--engine"] : "normal";
+            report_benchmark(std::cout, argv[1], engine, start, bench_peak_nodes(engine, nameless_data::line_arena.get_node_high_water()), e.what());
+        }
     }
 
     return 0;